@@ -1,214 +1,269 @@
-#include <pthread.h>
-#include <stdio.h>
-#include <stdlib.h>
-
 #include "accesscontrol.h"
 #include "alloc.h"
 #include "byte.h"
-#include "error.h"
-#include "hash.h"
+#include "openreadclose.h"
 #include "probefile.h"
+#include "scan.h"
 #include "serverstate.h"
 #include "sleep.h"
 #include "str.h"
-#include "uint64.h"
-
-#define MAX_BUCKETS 10000
+#include "stralloc.h"
+#include "uint32.h"
 
 // Part 2 - okclient avoid stat system call on every request
 
 /*
- * We are using a linked list to chain nodes when they collide
- * Could use a Binary search tree instead
- * Trade off will be slower insertion O(log n) and faster look up O(log n)
- * as opposed to faster insertion O(1) and slower look up O(n)
+ * accesscontrol.global has one entry per line: an address (1.2.3.4), a
+ * network in CIDR notation (1.2.3.0/24), or a dotted prefix (1.2.3) as
+ * with the old ip/ directory. Anything else on a line is ignored.
+ *
+ * The entries are turned into sorted, disjoint ranges of addresses.
+ * A stride table indexed by the first 16 bits of an address gives the
+ * slice of ranges that can hold it, and a binary search of that slice
+ * finds the first range ending at or after the address.
+ *
+ * Lookups read the current table through one pointer: no formatting,
+ * hashing, locking or allocation. A reload builds a new table and swaps
+ * the pointer.
+ *
+ * The table it replaces is kept until no worker can still be using it.
+ * Each worker has a counter it bumps when it goes offline, before it
+ * blocks waiting for events, and when it comes back online; the counter
+ * is odd while the worker is online. A replaced table remembers the
+ * counters at the time of the swap and is freed once every worker was
+ * offline then or has gone offline since.
  */
-struct IPnode {
-  char *ip;
-  struct IPnode* next;
+
+#define STRIDE 65536
+
+struct range {
+  uint32 lo;
+  uint32 hi;
 };
 
-struct Hashbucket {
-  struct IPnode* begin;
-  struct IPnode* end;
+struct acl {
+  struct acl *retired; /* next replaced table not freed yet */
+  unsigned long *seen; /* counters when this one was replaced */
+  unsigned int n;
+  unsigned int index[STRIDE + 1]; /* first range with hi >= i << 16 */
+  struct range r[1];
 };
 
 static time_t lastmodificationtime = 0;
 static char* accesscontrolpath = 0;
 static int alreadyinitialized = 0;
-static struct Hashbucket h[MAX_BUCKETS];
-static struct Hashbucket hauxillary[MAX_BUCKETS];
-static pthread_mutex_t hashmutex[MAX_BUCKETS];
+static struct acl *volatile current = 0;
+static struct acl *retired = 0;
+static stralloc file;
+
+struct reader {
+  volatile unsigned long passes;
+  char pad[64 - sizeof(unsigned long)]; /* a cache line each */
+};
+
+static struct reader *readers = 0;
+static unsigned int numreaders = 0;
 
 /*
- * create a new node for the IP address to be stored into the hash bucket
+ * parse one line into the range it covers
+ * Return 1 if the line is an entry, 0 otherwise
  */
-static struct IPnode* newnode(const char* ip) {
-  struct IPnode* ipnode = (struct IPnode*) malloc(sizeof(struct IPnode));
-  if(ipnode) {
-    ipnode->next = 0;
-    int iplen = str_len(ip) + 1;
-    ipnode->ip = (char *) alloc(iplen);
-    if(ipnode->ip) {
-      byte_copy(ipnode->ip, iplen, ip);
-    }
-    else {
-      free(ipnode);
-      ipnode = 0;
-    }
+static int parseline(const char *s, struct range *r) {
+  unsigned long u;
+  unsigned int i;
+  unsigned int octets = 0;
+  unsigned int bits;
+  uint32 ip = 0;
+  uint32 mask;
+
+  while(*s == ' ' || *s == '\t') ++s;
+  for(;;) {
+    i = scan_ulong(s, &u);
+    if(!i || u > 255) return 0;
+    ip = (ip << 8) | u;
+    s += i;
+    if(++octets == 4 || *s != '.') break;
+    ++s;
   }
+  ip <<= 8 * (4 - octets);
+  bits = 8 * octets;
+
+  if(*s == '/') {
+    i = scan_ulong(++s, &u);
+    if(!i || u > 32) return 0;
+    bits = u;
+    s += i;
+  }
+  while(*s == ' ' || *s == '\t' || *s == '\r') ++s;
+  if(*s && *s != '\n') return 0;
 
-  return ipnode;
+  mask = bits ? 0xffffffff << (32 - bits) : 0;
+  r->lo = ip & mask;
+  r->hi = ip | ~mask;
+  return 1;
 }
 
+static unsigned int count[STRIDE + 1];
+
 /*
- * Invoked whenever the access control list has been updated & update the hash bucket with IP entries
+ * sort n ranges by lo from x into y on 16 bits of lo, lowest at shift
+ * Stable, so two passes (shift 0, then 16) sort by all of lo
  */
-static void moveentriestomainbucket() {
-  int bucketnum;
-  for(bucketnum = 0; bucketnum < MAX_BUCKETS; bucketnum++) {
-    // critical section, swap out auxillary bucket and main bucket pointers
-    pthread_mutex_lock(&hashmutex[bucketnum]);
-
-    struct IPnode* temp = h[bucketnum].begin;
-    h[bucketnum].begin = hauxillary[bucketnum].begin;
-    hauxillary[bucketnum].begin = temp;
-    
-    temp = h[bucketnum].end;
-    h[bucketnum].end = hauxillary[bucketnum].end;
-    hauxillary[bucketnum].end = temp;
-
-    // end critical section
-    pthread_mutex_unlock(&hashmutex[bucketnum]);
-
-    // clear out auxillary hash bucket, need not be in critical region
-    struct IPnode* curr = hauxillary[bucketnum].begin;
-    while(curr) {
-      struct IPnode* next = curr->next;
-      alloc_free(curr->ip);
-      free(curr);
-      curr = next;
-    }
+static void radixpass(const struct range *x, struct range *y, unsigned int n, int shift) {
+  unsigned int i;
 
-    // make current bucket point to new entries read from access control list stored in auxillary hash bucket
-    hauxillary[bucketnum].begin = 0;
-    hauxillary[bucketnum].end = 0;
+  byte_zero(count, sizeof count);
+  for(i = 0; i < n; i++) {
+    count[((x[i].lo >> shift) & 0xffff) + 1]++;
+  }
+  for(i = 0; i < STRIDE; i++) {
+    count[i + 1] += count[i];
+  }
+  for(i = 0; i < n; i++) {
+    y[count[(x[i].lo >> shift) & 0xffff]++] = x[i];
   }
 }
 
 /*
- * add IP address into the auxillary hash bucket
+ * Free the replaced tables no worker can be using any more
  */
-static void addIPtoauxillarybucket(const char* ip) {
-  if(!ip) {
-    return;
-  }
-  uint64 hashval = hashcode(ip, str_len(ip));
-  int bucketnum = hashval % MAX_BUCKETS;
-
-  struct IPnode* ipnode = newnode(ip);
-  if(!ipnode) {
-    return;
-  }
-
-  if(!hauxillary[bucketnum].begin) {
-    hauxillary[bucketnum].begin = ipnode;
-  }
-  else {
-    hauxillary[bucketnum].end->next = ipnode;
+static void reclaim() {
+  struct acl **p = &retired;
+  struct acl *a;
+  unsigned int i;
+
+  while((a = *p)) {
+    for(i = 0; i < numreaders; i++) {
+      if((a->seen[i] & 1) && readers[i].passes == a->seen[i]) break;
+    }
+    if(i < numreaders) {
+      p = &a->retired;
+      continue;
+    }
+    *p = a->retired;
+    alloc_free((char *) a->seen);
+    alloc_free((char *) a);
   }
-  hauxillary[bucketnum].end = ipnode;
 }
 
 /*
  * Invoked whenever the access control list has been updated
- * Read from access control list and update which IPs are allowed
+ * Read from access control list, build a new table and make it current
  */
 static void getUpdatedAccessControlList() {
-  FILE* fptr = fopen(accesscontrolpath, "r");
-  if (!fptr) {
+  struct acl *a;
+  struct acl *old;
+  struct range *tmp;
+  unsigned int lines = 0;
+  unsigned int n = 0;
+  unsigned int i;
+  unsigned int j;
+
+  if(openreadclose(accesscontrolpath, &file, 65536) != 1) {
+    return;
+  }
+  if(!stralloc_0(&file)) {
     return;
   }
+  for(i = 0; i < file.len; i++) {
+    if(file.s[i] == '\n') lines++;
+  }
 
-  while(!feof(fptr)) {
-    size_t len;
-    char* ip = 0;
-    size_t ret = getline(&ip, &len, fptr);
-    if(!feof(fptr)) {
-      if(ip) {
-        if(ip[ret - 1] == '\n') {
-          ip[ret - 1] = '\0';
-        }
-        addIPtoauxillarybucket(ip);
-        free(ip);
-      }
-    }
+  a = (struct acl *) alloc(sizeof(struct acl) + (lines + 1) * sizeof(struct range));
+  if(!a) {
+    return;
+  }
+  a->seen = (unsigned long *) alloc(numreaders * sizeof(unsigned long));
+  if(!a->seen) {
+    alloc_free((char *) a);
+    return;
+  }
+  tmp = (struct range *) alloc((lines + 1) * sizeof(struct range));
+  if(!tmp) {
+    alloc_free((char *) a->seen);
+    alloc_free((char *) a);
+    return;
   }
 
-  moveentriestomainbucket();
-  
-  fclose(fptr);
-}
+  for(i = 0; i < file.len - 1; i += str_chr(file.s + i, '\n') + 1) {
+    if(parseline(file.s + i, &a->r[n])) n++;
+  }
 
-/*
- * Initialize auxillary and main hash tables buckets to be empty
- */
-static void initializehashbuckets() {
-  int i;
-  for(int i = 0; i < MAX_BUCKETS; i++) {
-    h[i].begin = 0;
-    h[i].end = 0;
-    hauxillary[i].begin = 0;
-    hauxillary[i].end = 0;
+  // sort and merge overlapping or adjacent ranges
+  radixpass(a->r, tmp, n, 0);
+  radixpass(tmp, a->r, n, 16);
+  alloc_free(tmp);
+  j = 0;
+  for(i = 0; i < n; i++) {
+    if(j && (a->r[j - 1].hi == 0xffffffff || a->r[i].lo <= a->r[j - 1].hi + 1)) {
+      if(a->r[i].hi > a->r[j - 1].hi) a->r[j - 1].hi = a->r[i].hi;
+    }
+    else {
+      a->r[j++] = a->r[i];
+    }
   }
-}
+  a->n = j;
 
-/*
- * Intiailize all mutexes to control concurrent access to hash buckets
- * Return 1 if initialization succeeds, -1 if it fails
- */
-static int intializemutexes() {
-  for(int i = 0; i < MAX_BUCKETS; i++) {
-    if(pthread_mutex_init(&hashmutex[i], 0) != 0) {
-      return -1;
+  j = 0;
+  for(i = 0; i < STRIDE; i++) {
+    while(j < a->n && a->r[j].hi < ((uint32) i << 16)) j++;
+    a->index[i] = j;
+  }
+  a->index[STRIDE] = a->n;
+
+  __sync_synchronize();
+  old = current;
+  current = a;
+  __sync_synchronize();
+  if(old) {
+    for(i = 0; i < numreaders; i++) {
+      old->seen[i] = readers[i].passes;
     }
+    old->retired = retired;
+    retired = old;
   }
-  return 1;
 }
 
 /*
  * Replacement to stat system call in okclient
- * invoked to verify whether an IP has been greenlit (based on accesscontrol list)
- * Access critical section to access all entries in a given bucket
+ * invoked to verify whether an IP (4 bytes, network order) has been greenlit
  * Returns 0 if IP should not be allowed, 1 otherwise
  */
-int allowaccesstoip(const char* ip) {
-  if(!ip || !alreadyinitialized) {
+int allowaccesstoip(const char ip[4]) {
+  struct acl *a = current;
+  unsigned int lo;
+  unsigned int hi;
+  unsigned int mid;
+  uint32 u;
+
+  if(!a) {
     return 0;
   }
 
-  // Determine the bucket for the IP based on its hash code
-  uint64 hashval = hashcode(ip, str_len(ip));
-  int bucketnum = hashval % MAX_BUCKETS;
-  int found = 0;
+  uint32_unpack_big(ip, &u);
 
-  // Critical section
-  pthread_mutex_lock(&hashmutex[bucketnum]);
-
-  // Search within the hashbucket if the IP exists
-  struct IPnode* curr = h[bucketnum].begin;
-  while(curr) {
-    if(str_equal(curr->ip, ip)) {
-      found = 1;
-      break;
-    }
-    curr = curr->next;
+  // first range with hi >= u lies in [index[k], index[k + 1]]
+  lo = a->index[u >> 16];
+  hi = a->index[(u >> 16) + 1];
+  while(lo < hi) {
+    mid = (lo + hi) / 2;
+    if(a->r[mid].hi < u) lo = mid + 1;
+    else hi = mid;
   }
 
-  // End of critical section
-  pthread_mutex_unlock(&hashmutex[bucketnum]);
+  return lo < a->n && a->r[lo].lo <= u;
+}
+
+/*
+ * Worker r holds no table until accesscontrol_online(r)
+ * Only worker r changes its counter; each call is also a full barrier
+ */
+void accesscontrol_offline(unsigned int r) {
+  __sync_fetch_and_add(&readers[r].passes, readers[r].passes & 1);
+}
 
-  return found;
+void accesscontrol_online(unsigned int r) {
+  __sync_fetch_and_add(&readers[r].passes, ~readers[r].passes & 1);
 }
 
 /*
@@ -224,16 +279,20 @@ void* updateAccessControl(void *dummyparam) {
     if(probefile(accesscontrolpath, &lastmodificationtime)) {
       getUpdatedAccessControlList();
     }
+    reclaim();
   }
 
   return 0;
 }
 
 /*
- * Initialize accesscontrol by providing accesscontrol file path and the hash buckets
+ * Initialize accesscontrol by providing accesscontrol file path and the
+ * number of workers that will call allowaccesstoip
  * Return 1 if successful -1 in case of failure
  */
-int initializeaccesscontrol(const char *path) {
+int initializeaccesscontrol(const char *path, unsigned int workers) {
+  unsigned int i;
+
   if(!path) {
     return -1;
   }
@@ -243,11 +302,6 @@ int initializeaccesscontrol(const char *path) {
     return -1;
   }
 
-  if(intializemutexes() != 1) {
-    return -1;
-  }
-  initializehashbuckets();
-
   int len = str_len(path) + 1;
   accesscontrolpath = alloc(len);
   if(!accesscontrolpath) {
@@ -256,6 +310,16 @@ int initializeaccesscontrol(const char *path) {
 
   byte_copy(accesscontrolpath, len, path);
 
+  readers = (struct reader *) alloc(workers * sizeof(struct reader));
+  if(!readers) {
+    return -1;
+  }
+  byte_zero(readers, workers * sizeof(struct reader));
+  numreaders = workers;
+  for(i = 0; i < workers; i++) {
+    readers[i].passes = 1; // workers start online
+  }
+
   alreadyinitialized = 1;
 
   return 1;
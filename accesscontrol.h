@@ -1,8 +1,10 @@
 #ifndef ACCESSCONTROL_H
 #define ACCESSCONTROL_H
 
-extern int initializeaccesscontrol(const char *);
+extern int initializeaccesscontrol(const char *, unsigned int);
 extern void* updateAccessControl(void *);
-extern int allowaccesstoip(const char*);
+extern int allowaccesstoip(const char *);
+extern void accesscontrol_offline(unsigned int);
+extern void accesscontrol_online(unsigned int);
 
 #endif
@@ -14,8 +14,13 @@ static unsigned int avail = SPACE; /* multiple of ALIGNMENT; 0<=avail<=SPACE */
 unsigned int n;
 {
   char *x;
+  unsigned int a;
   n = ALIGNMENT + n - (n & (ALIGNMENT - 1)); /* XXX: could overflow */
-  if (n <= avail) { avail -= n; return space + avail; }
+  for (;;) { /* threads may race for the space */
+    a = avail;
+    if (n > a) break;
+    if (__sync_bool_compare_and_swap(&avail,a,a - n)) return space + a - n;
+  }
   x = malloc(n);
   if (!x) errno = error_nomem;
   return x;
@@ -0,0 +1,59 @@
+#include "alloc.h"
+#include "arena.h"
+
+/*
+ * Memory comes from blocks of BLOCK bytes, or bigger for a bigger request,
+ * and is only given back by arena_reset, all at once. arena_reset keeps the
+ * oldest block, so an arena that is reused settles at one block and stops
+ * calling alloc.
+ */
+
+#define BLOCK 1024
+#define ALIGN 8
+
+struct header {
+  char *prev;
+  unsigned int len;
+} ;
+#define HEAD ((sizeof(struct header) + ALIGN - 1) & ~(ALIGN - 1))
+
+char *arena_alloc(struct arena *a,unsigned int n)
+{
+  struct header *h;
+  unsigned int len;
+  char *x;
+
+  n = (n + ALIGN - 1) & ~(ALIGN - 1);
+  if (a->block && (n <= a->len - a->used)) {
+    x = a->block + a->used;
+    a->used += n;
+    return x;
+  }
+
+  len = BLOCK;
+  if (n > BLOCK - HEAD) len = HEAD + n;
+  x = alloc(len);
+  if (!x) return 0;
+  h = (struct header *) x;
+  h->prev = a->block;
+  h->len = len;
+  a->block = x;
+  a->len = len;
+  a->used = HEAD + n;
+  return x + HEAD;
+}
+
+void arena_reset(struct arena *a)
+{
+  struct header *h;
+
+  if (!a->block) return;
+  for (;;) {
+    h = (struct header *) a->block;
+    if (!h->prev) break;
+    a->block = h->prev;
+    alloc_free((char *) h);
+  }
+  a->len = h->len;
+  a->used = HEAD;
+}
@@ -0,0 +1,15 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+/* bump allocator for data that all dies at once; zero-filled is empty */
+
+struct arena {
+  char *block; /* newest block; each block points to the one before */
+  unsigned int used;
+  unsigned int len;
+} ;
+
+extern /*@null@*//*@out@*/char *arena_alloc(struct arena *,unsigned int);
+extern void arena_reset(struct arena *);
+
+#endif
@@ -1,6 +1,8 @@
+#include <pthread.h>
 #include "alloc.h"
 #include "byte.h"
 #include "cache.h"
+#include "case.h"
 #include "exit.h"
 #include "tai.h"
 #include "uint32.h"
@@ -15,6 +17,15 @@ static uint32 oldest;
 static uint32 unused;
 static uint32 notfound;
 
+/*
+dnscache worker threads share the cache. Every entry point holds the
+lock while it touches x, and cache_get hands out a copy of the data in a
+buffer of the calling thread, valid until that thread's next cache_get.
+*/
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread char *copy = 0;
+static __thread unsigned int copysize = 0;
+
 /*
 100 <= size <= 1000000000.
 4 <= hsize <= size/16.
@@ -38,11 +49,53 @@ the positions of the adjacent items in the list.
 Entries are always inserted immediately after the head and removed at the tail.
 
 Each entry contains the following information:
-4-byte link; 4-byte keylen; 4-byte datalen; 8-byte expire time; key; data.
+4-byte link; 4-byte keylen; 4-byte datalen; 8-byte expire time;
+4-byte node; 4-byte node link; key; data.
 */
 
 #define MAXKEYLEN 1000
 #define MAXDATALEN 1000000
+#define HEADER 28
+
+/*
+Keys that are a type followed by a name, possibly followed by more bytes,
+are also indexed in a tree of labels. Each node stands for a name; its
+parent stands for the name without the first label. A node lists the
+entries for its name, oldest first, linked through the node link of each
+entry like the hash buckets. Since entries leave the cache oldest first,
+the entry removed is always the first of its node.
+
+A node lives as long as it has entries or children. Nodes do not hold
+their label but the position of a copy of it in x, inside the key of an
+entry for the node or for a name below it; when that entry leaves, the
+label is found again in the key of another one. So the closest enclosing
+zone of a name, and everything cached below a name, are found with one
+walk down the tree.
+
+The root is node 1 and stays. Nodes take a quarter of the cache size;
+when they run out, old entries leave to free some.
+*/
+
+struct node {
+  uint32 parent;
+  uint32 next; /* in the bucket, or in the free list */
+  uint32 child; /* one of the children, 0 if none */
+  uint32 sibling;
+  uint32 prevsibling;
+  uint32 first; /* oldest entry, 0 if none */
+  uint32 last; /* newest entry */
+  uint32 refs; /* entries and children */
+  uint32 label; /* position in x of the label */
+} ;
+
+#define ROOT 1
+
+static struct node *node = 0;
+static uint32 numnodes;
+static uint32 *nodebucket = 0;
+static uint32 nodebuckets;
+static uint32 freenodes;
+static uint32 numfree;
 
 static void cache_impossible(void)
 {
@@ -63,23 +116,202 @@ static uint32 get4(uint32 pos)
   return result;
 }
 
-static unsigned int hash(const char *key,unsigned int keylen)
+/*
+Callers pass the hash of the key, from hashkey or from hashname and
+hashtype; a name's hash serves every type and ancestor probed for it.
+*/
+static uint32 bucket(uint32 h)
+{
+  h <<= 2;
+  h &= hsize - 4;
+  return h;
+}
+
+static uint32 labelhash(uint32 parent,const char *label)
 {
-  unsigned int result = 5381;
+  uint32 h = 5381 + parent;
+  unsigned int len = 1 + (unsigned char) *label;
+  unsigned char ch;
+
+  while (len--) {
+    ch = *label++;
+    if (ch >= 'A' && ch <= 'Z') ch += 32;
+    h = (h << 5) + h;
+    h ^= ch;
+  }
+  return h & (nodebuckets - 1);
+}
 
-  while (keylen) {
-    result = (result << 5) + result;
-    result ^= (unsigned char) *key;
-    ++key;
-    --keylen;
+static uint32 node_find(uint32 parent,const char *label)
+{
+  uint32 n;
+  const char *y;
+
+  for (n = nodebucket[labelhash(parent,label)];n;n = node[n].next) {
+    if (node[n].parent != parent) continue;
+    y = x + node[n].label;
+    if (*y != *label) continue;
+    if (!case_diffb(y + 1,(unsigned char) *label,label + 1)) return n;
   }
-  result <<= 2;
-  result &= hsize - 4;
-  return result;
+  return 0;
+}
+
+/* label is at x + pos; there must be a free node */
+static uint32 node_add(uint32 parent,uint32 pos)
+{
+  uint32 n;
+  uint32 b;
+
+  n = freenodes;
+  if (!n) cache_impossible();
+  freenodes = node[n].next;
+  --numfree;
+
+  byte_zero(&node[n],sizeof(struct node));
+  node[n].parent = parent;
+  node[n].label = pos;
+  b = labelhash(parent,x + pos);
+  node[n].next = nodebucket[b];
+  nodebucket[b] = n;
+
+  node[n].sibling = node[parent].child;
+  if (node[n].sibling) node[node[n].sibling].prevsibling = n;
+  node[parent].child = n;
+  ++node[parent].refs;
+  return n;
+}
+
+/* n has no entries and no children */
+static void node_free(uint32 n)
+{
+  uint32 *p;
+
+  p = nodebucket + labelhash(node[n].parent,x + node[n].label);
+  while (*p != n) p = &node[*p].next;
+  *p = node[n].next;
+
+  if (node[n].prevsibling)
+    node[node[n].prevsibling].sibling = node[n].sibling;
+  else
+    node[node[n].parent].child = node[n].sibling;
+  if (node[n].sibling)
+    node[node[n].sibling].prevsibling = node[n].prevsibling;
+  --node[node[n].parent].refs;
+
+  node[n].next = freenodes;
+  freenodes = n;
+  ++numfree;
+}
+
+/*
+Offsets in key of the labels of its name, then of the name's final 0
+Return the number of labels, or -1 if key is not a type and a name
+*/
+static int keylabels(const char *key,unsigned int keylen,unsigned int label[128])
+{
+  unsigned int pos = 2;
+  int n = 0;
+
+  for (;;) {
+    if (pos >= keylen) return -1;
+    if (!key[pos]) break;
+    if (n == 127) return -1;
+    label[n++] = pos;
+    pos += 1 + (unsigned char) key[pos];
+  }
+  label[n] = pos;
+  return n;
+}
+
+/* add the entry at pos, just written, to the node of its name */
+static void tree_add(uint32 pos,const char *key,unsigned int keylen)
+{
+  unsigned int label[128];
+  int n;
+  uint32 m;
+  uint32 c;
+  uint32 last;
+
+  n = keylabels(key,keylen,label);
+  if (n < 0) return;
+
+  m = ROOT;
+  while (n > 0) {
+    --n;
+    c = node_find(m,key + label[n]);
+    if (!c) c = node_add(m,pos + HEADER + label[n]);
+    m = c;
+  }
+
+  last = node[m].last;
+  set4(pos + 20,m);
+  set4(pos + 24,last);
+  if (last) set4(last + 24,get4(last + 24) ^ pos);
+  else node[m].first = pos;
+  node[m].last = pos;
+  ++node[m].refs;
+}
+
+/* the oldest entry, at pos, is leaving */
+static void tree_drop(uint32 pos)
+{
+  uint32 end;
+  uint32 next;
+  uint32 m;
+  uint32 parent;
+  uint32 c;
+
+  m = get4(pos + 20);
+  if (!m) return;
+  if (m >= numnodes || node[m].first != pos) cache_impossible();
+  end = pos + HEADER + get4(pos + 4) + get4(pos + 8);
+
+  next = get4(pos + 24);
+  if (next) set4(next + 24,get4(next + 24) ^ pos);
+  else node[m].last = 0;
+  node[m].first = next;
+  --node[m].refs;
+
+  while (m != ROOT) {
+    parent = node[m].parent;
+    if (!node[m].refs)
+      node_free(m);
+    else if ((node[m].label >= pos) && (node[m].label < end)) {
+      if (node[m].first)
+        node[m].label = node[m].first + HEADER + 2;
+      else {
+        c = node[m].child;
+        node[m].label = node[c].label + 1 + (unsigned char) x[node[c].label];
+      }
+    }
+    m = parent;
+  }
+}
+
+/* newest live entry of node m with this type and keylen, if it has enough data; 0 if none */
+static uint32 node_entry(uint32 m,const char type[2],unsigned int keylen,unsigned int minlen,struct tai *now)
+{
+  struct tai expire;
+  uint32 pos;
+  uint32 newer;
+  uint32 older;
+
+  newer = 0;
+  for (pos = node[m].last;pos;pos = older) {
+    older = get4(pos + 24) ^ newer;
+    newer = pos;
+    if (get4(pos + 4) != keylen) continue;
+    if (byte_diff(x + pos + HEADER,2,type)) continue;
+    tai_unpack(x + pos + 12,&expire);
+    if (tai_less(&expire,now)) continue;
+    if (get4(pos + 8) < minlen) return 0;
+    return pos;
+  }
+  return 0;
 }
 
 // Part 3 - cache_delete, refactored to find key for cache_get & cache_delete
-static uint32 cache_find(const char *key,unsigned int keylen) {
+static uint32 cache_find(const char *key,unsigned int keylen,uint32 h) {
   struct tai expire;
   struct tai now;
   uint32 pos;
@@ -94,36 +326,32 @@ static uint32 cache_find(const char *key,unsigned int keylen) {
     return notfound;
   }
 
-  prevpos = hash(key,keylen);
+  prevpos = bucket(h);
   pos = get4(prevpos);
   loop = 0;
 
   /*
-   * 4-byte link; 4-byte keylen; 4-byte datalen; 8-byte expire time; key; data.
+   * 4-byte link; 4-byte keylen; 4-byte datalen; 8-byte expire time;
+   * 4-byte node; 4-byte node link; key; data.
    */
   while (pos) {
     // Get key len and proceed only if keys are of the same length
     if (get4(pos + 4) == keylen) {
       // Boundary check before reading the key
-      if (pos + 20 + keylen > size) cache_impossible();
+      if (pos + HEADER + keylen > size) cache_impossible();
 
-      if (byte_equal(key, keylen, x + pos + 20)) {
+      if (byte_equal(key, keylen, x + pos + HEADER)) {
         // Found the key at that position
 
         // Boundary check for data
         u = get4(pos + 8);
-        if (u > size - pos - 20 - keylen) cache_impossible();
+        if (u > size - pos - HEADER - keylen) cache_impossible();
 
         tai_unpack(x + pos + 12, &expire);
         tai_now(&now);
 
-        // key has already expired
-        if (tai_less(&expire,&now)) {
-          // Set key to an invalid value, assumes we don't have a key set to all 0s
-          byte_zero(x + pos + 20, keylen);
-          // Do not return, keep looking if there is a fresh copy of the key in the byte array
-        }
-        else {
+        // key has already expired, keep looking if there is a fresh copy of the key
+        if (!tai_less(&expire,&now)) {
           // return position of the entry for the key
           return pos;
         }
@@ -146,36 +374,35 @@ static uint32 cache_find(const char *key,unsigned int keylen) {
   return notfound;
 }
 
-void cache_delete(const char *key, unsigned int keylen) {
+/*
+ * Deleted entries stay in place, expired; the key is kept intact since
+ * the label tree may point into it.
+ */
+void cache_delete(const char *key, unsigned int keylen, uint32 h) {
   uint32 pos;
 
-  pos = cache_find(key, keylen);
-  if(pos == notfound) {
-    return;
+  pthread_mutex_lock(&lock);
+  pos = cache_find(key, keylen, h);
+  if(pos != notfound) {
+    byte_zero(x + pos + 12, 8);
   }
-
-  // Set key to an invalid value, assumes we don't have a key set to all 0s
-  byte_zero(x + pos + 20, keylen);
+  pthread_mutex_unlock(&lock);
 }
 
-char *cache_get(const char *key, unsigned int keylen, unsigned int *datalen, uint32 *ttl)
+/* copy the data of the entry at pos for the calling thread; lock is held */
+static char *copyout(uint32 pos, unsigned int *datalen, uint32 *ttl)
 {
   struct tai expire;
   struct tai now;
-  uint32 pos;
   double d;
 
-  pos = cache_find(key, keylen);
-  if(pos == notfound) {
-    return 0;
-  }
-
   /*
-   * 4-byte link; 4-byte keylen; 4-byte datalen; 8-byte expire time; key; data.
+   * 4-byte link; 4-byte keylen; 4-byte datalen; 8-byte expire time;
+   * 4-byte node; 4-byte node link; key; data.
    */
   tai_unpack(x + pos + 12, &expire);
   tai_now(&now);
-        
+
   tai_sub(&expire, &expire, &now);
   d = tai_approx(&expire);
 
@@ -188,15 +415,143 @@ char *cache_get(const char *key, unsigned int keylen, unsigned int *datalen, uin
   // Get datalen
   *datalen = get4(pos + 8);
 
-  return x + pos + 20 + keylen;
+  if (!copy || *datalen > copysize) {
+    if (copy) alloc_free(copy);
+    copysize = *datalen + 256;
+    copy = alloc(copysize);
+    if (!copy) {
+      copysize = 0;
+      return 0;
+    }
+  }
+  byte_copy(copy, *datalen, x + pos + HEADER + get4(pos + 4));
+  return copy;
+}
+
+char *cache_get(const char *key, unsigned int keylen, uint32 h, unsigned int *datalen, uint32 *ttl)
+{
+  uint32 pos;
+  char *result;
+
+  pthread_mutex_lock(&lock);
+  pos = cache_find(key, keylen, h);
+  if(pos == notfound) {
+    pthread_mutex_unlock(&lock);
+    return 0;
+  }
+  result = copyout(pos, datalen, ttl);
+  pthread_mutex_unlock(&lock);
+
+  return result;
 }
 
-void cache_set(const char *key,unsigned int keylen,const char *data,unsigned int datalen,uint32 ttl)
+/*
+ * The entry with this type for the longest of d and its ancestors that has
+ * one with at least minlen bytes of data; *skip is the number of labels
+ * removed from d to get that name. One walk down the label tree.
+ */
+char *cache_getancestor(const char type[2], const char *d, unsigned int minlen, unsigned int *skip, unsigned int *datalen, uint32 *ttl)
+{
+  unsigned int label[128];
+  unsigned int n;
+  unsigned int i;
+  unsigned int dlen;
+  struct tai now;
+  uint32 m;
+  uint32 pos;
+  uint32 found;
+  char *result;
+
+  n = 0;
+  for (i = 0;d[i];i += 1 + (unsigned char) d[i]) {
+    if (n == 127) return 0;
+    label[n++] = i;
+  }
+  label[n] = i;
+  dlen = i + 1;
+
+  tai_now(&now);
+  pthread_mutex_lock(&lock);
+  if (!x) {
+    pthread_mutex_unlock(&lock);
+    return 0;
+  }
+
+  found = 0;
+  m = ROOT;
+  for (i = n;;) {
+    pos = node_entry(m, type, 2 + dlen - label[i], minlen, &now);
+    if (pos) {
+      found = pos;
+      *skip = i;
+    }
+    if (!i) break;
+    m = node_find(m, d + label[--i]);
+    if (!m) break;
+  }
+
+  result = found ? copyout(found, datalen, ttl) : 0;
+  pthread_mutex_unlock(&lock);
+  return result;
+}
+
+/*
+ * Expire every entry for d and for the names below it
+ */
+void cache_purge(const char *d)
+{
+  unsigned int label[128];
+  unsigned int n;
+  unsigned int i;
+  uint32 top;
+  uint32 m;
+  uint32 pos;
+  uint32 newer;
+  uint32 older;
+
+  n = 0;
+  for (i = 0;d[i];i += 1 + (unsigned char) d[i]) {
+    if (n == 127) return;
+    label[n++] = i;
+  }
+
+  pthread_mutex_lock(&lock);
+  if (!x) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  m = ROOT;
+  while (m && n) m = node_find(m, d + label[--n]);
+
+  top = m;
+  while (m) {
+    older = 0;
+    for (pos = node[m].first;pos;pos = newer) {
+      newer = get4(pos + 24) ^ older;
+      older = pos;
+      byte_zero(x + pos + 12, 8);
+    }
+
+    if (node[m].child) {
+      m = node[m].child;
+      continue;
+    }
+    while ((m != top) && !node[m].sibling) m = node[m].parent;
+    if (m == top) break;
+    m = node[m].sibling;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void cache_set(const char *key,unsigned int keylen,uint32 h,const char *data,unsigned int datalen,uint32 ttl)
 {
   struct tai now;
   struct tai expire;
   unsigned int entrylen;
   unsigned int keyhash;
+  unsigned int label[128];
+  int labels;
   uint32 pos;
 
   // Parameter validation
@@ -208,29 +563,45 @@ void cache_set(const char *key,unsigned int keylen,const char *data,unsigned int
   if (ttl > 604800) ttl = 604800;
 
   /*
-   * 4-byte link; 4-byte keylen; 4-byte datalen; 8-byte expire time; key; data.
+   * 4-byte link; 4-byte keylen; 4-byte datalen; 8-byte expire time;
+   * 4-byte node; 4-byte node link; key; data.
    */
-  entrylen = keylen + datalen + 20;
+  entrylen = keylen + datalen + HEADER;
+
+  keyhash = bucket(h);
+  labels = keylabels(key, keylen, label);
+
+  tai_now(&now);
+  tai_uint(&expire,ttl);
+  tai_add(&expire,&expire,&now);
 
   /*
    * hsize <= writer <= oldest <= unused <= size.
    * If oldest == unused then unused == size.
    */
+  pthread_mutex_lock(&lock);
+
   // Keep moving oldest until it's outside the boundary of the latest entry to be inserted
-  while (writer + entrylen > oldest) {
+  // and there are enough free nodes for its name
+  while ((writer + entrylen > oldest) || (labels > (int) numfree)) {
     if (oldest == unused) {
-      if (writer <= hsize) return;
+      if (writer <= hsize) {
+        pthread_mutex_unlock(&lock);
+        return;
+      }
       unused = writer;
       oldest = hsize;
       writer = hsize;
+      continue;
     }
 
     pos = get4(oldest);
 
     set4(pos, get4(pos) ^ oldest);
- 
-    // Move oldest by an entry 
-    oldest += get4(oldest + 4) + get4(oldest + 8) + 20;
+    tree_drop(oldest);
+
+    // Move oldest by an entry
+    oldest += get4(oldest + 4) + get4(oldest + 8) + HEADER;
     if (oldest > unused) cache_impossible();
     if (oldest == unused) {
       unused = size;
@@ -238,12 +609,6 @@ void cache_set(const char *key,unsigned int keylen,const char *data,unsigned int
     }
   }
 
-  keyhash = hash(key, keylen);
-
-  tai_now(&now);
-  tai_uint(&expire,ttl);
-  tai_add(&expire,&expire,&now);
-
   pos = get4(keyhash);
   if (pos) {
     set4(pos, get4(pos) ^ keyhash ^ writer);
@@ -252,24 +617,45 @@ void cache_set(const char *key,unsigned int keylen,const char *data,unsigned int
   set4(writer + 4,keylen);
   set4(writer + 8,datalen);
   tai_pack(x + writer + 12, &expire);
-  byte_copy(x + writer + 20,keylen, key);
-  byte_copy(x + writer + 20 + keylen, datalen, data);
+  set4(writer + 20,0);
+  byte_copy(x + writer + HEADER,keylen, key);
+  byte_copy(x + writer + HEADER + keylen, datalen, data);
+  tree_add(writer, key, keylen);
 
   // value at pos keyhash will point to writer i.e. whether key has been written
   set4(keyhash, writer);
   writer += entrylen;
   cache_motion += entrylen;
+  pthread_mutex_unlock(&lock);
 }
 
 int cache_init(unsigned int cachesize)
 {
+  uint32 u;
+  uint32 i;
+
   if (x) {
     alloc_free(x);
     x = 0;
   }
+  if (node) {
+    alloc_free((char *) node);
+    node = 0;
+  }
+  if (nodebucket) {
+    alloc_free((char *) nodebucket);
+    nodebucket = 0;
+  }
 
   if (cachesize > 1000000000) cachesize = 1000000000;
   if (cachesize < 100) cachesize = 100;
+
+  numnodes = cachesize / 4 / (sizeof(struct node) + 4);
+  if (numnodes < 256) numnodes = 256;
+  for (nodebuckets = 1;nodebuckets * 2 <= numnodes;nodebuckets *= 2) ;
+  u = numnodes * sizeof(struct node) + nodebuckets * 4;
+  if (u < cachesize / 2) cachesize -= u;
+
   size = cachesize;
   // an out of bound index for hash array indicating a key could not be located
   notfound = size + 1;
@@ -281,6 +667,21 @@ int cache_init(unsigned int cachesize)
   if (!x) return 0;
   byte_zero(x,size);
 
+  node = (struct node *) alloc(numnodes * sizeof(struct node));
+  nodebucket = (uint32 *) alloc(nodebuckets * 4);
+  if (!node || !nodebucket) return 0;
+  byte_zero(node,numnodes * sizeof(struct node));
+  byte_zero(nodebucket,nodebuckets * 4);
+
+  /* node 0 is none, node 1 the root, the rest free */
+  freenodes = 0;
+  numfree = 0;
+  for (i = numnodes - 1;i > ROOT;--i) {
+    node[i].next = freenodes;
+    freenodes = i;
+    ++numfree;
+  }
+
   writer = hsize;
   oldest = size;
   unused = size;
@@ -6,8 +6,10 @@
 
 extern uint64 cache_motion;
 extern int cache_init(unsigned int);
-extern void cache_set(const char *,unsigned int,const char *,unsigned int,uint32);
-extern char *cache_get(const char *,unsigned int,unsigned int *,uint32 *);
-extern void cache_delete(const char *, unsigned int);
+extern void cache_set(const char *,unsigned int,uint32,const char *,unsigned int,uint32);
+extern char *cache_get(const char *,unsigned int,uint32,unsigned int *,uint32 *);
+extern void cache_delete(const char *,unsigned int,uint32);
+extern char *cache_getancestor(const char *,const char *,unsigned int,unsigned int *,unsigned int *,uint32 *);
+extern void cache_purge(const char *);
 
 #endif
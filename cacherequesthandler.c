@@ -47,7 +47,7 @@ static void addtocache(char* key, char* data, uint32 keylen, const uint32 datale
   if (ttl > MAXTTL) {
     ttl = MAXTTL;
   }
-  uint64 hashval = hashcode(key, keylen);
+  uint32 hashval = hashkey(key, keylen);
   int bucketnum = hashval % MAX_BUCKETS;
 
   struct Cachenode* newnode = (struct Cachenode*) malloc(sizeof(struct Cachenode));
@@ -110,7 +110,7 @@ static void cachegetentry(const char* buffer, const int reqlen, const uint32 key
   }
 
   const char *key = buffer + 5;
-  uint64 hashval = hashcode(key, keylen);
+  uint32 hashval = hashkey(key, keylen);
   int bucketnum = hashval % MAX_BUCKETS;
   
   struct Cachenode* curr = h[bucketnum].begin;
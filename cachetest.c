@@ -1,11 +1,159 @@
+#include "alloc.h"
 #include "buffer.h"
+#include "byte.h"
+#include "dns.h"
 #include "exit.h"
 #include "cachewrapper.h"
+#include "hash.h"
 #include "str.h"
 
 /*
  * ./cachetest www.google.com:172.217.3.164 www.google.com www.google.com:delete www.google.com
+ *
+ * name:purge drops name and everything below it; the distributed cache
+ * does not support it. Without arguments, cachetest checks the label tree
+ * of a small local cache instead.
  */
+
+static void fail(const char *what)
+{
+  buffer_puts(buffer_1, "failed: ");
+  buffer_puts(buffer_1, what);
+  buffer_puts(buffer_1, "\n");
+  buffer_flush(buffer_1);
+  _exit(111);
+}
+
+static char *name(const char *dotted)
+{
+  char *d = 0;
+
+  if (!dns_domain_fromdot(&d, dotted, str_len(dotted))) _exit(111);
+  return d;
+}
+
+/* key for type and name, as query.c makes them; returns its length */
+static unsigned int key(char k[257], const char type[2], const char *dotted)
+{
+  char *d = name(dotted);
+  unsigned int len = dns_domain_length(d);
+
+  byte_copy(k, 2, type);
+  byte_copy(k + 2, len, d);
+  alloc_free(d);
+  return len + 2;
+}
+
+static void set(const char type[2], const char *dotted, const char *data)
+{
+  char k[257];
+  unsigned int len = key(k, type, dotted);
+
+  cache_set_wrapper(k, len, hashkey(k, len), data, str_len(data), 3600);
+}
+
+static int get(const char type[2], const char *dotted)
+{
+  char k[257];
+  unsigned int len = key(k, type, dotted);
+  unsigned int u;
+  uint32 ttl;
+
+  return cache_get_wrapper(k, len, hashkey(k, len), &u, &ttl) != 0;
+}
+
+static void purge(const char *dotted)
+{
+  char *d = name(dotted);
+
+  cache_purge_wrapper(d);
+  alloc_free(d);
+}
+
+/*
+ * the data cached for type at dotted or its closest ancestor, with at
+ * least minlen bytes, must be want (0: none) after removing skip labels
+ */
+static void ancestor(const char type[2], const char *dotted, unsigned int minlen, const char *want, unsigned int skip)
+{
+  struct namehash nh;
+  char *d = name(dotted);
+  char *y;
+  unsigned int u;
+  unsigned int s;
+  uint32 ttl;
+
+  hashname(&nh, d);
+  y = cache_getancestor_wrapper(type, d, &nh, minlen, &s, &u, &ttl);
+  alloc_free(d);
+
+  if (!want) {
+    if (y) fail(dotted);
+    return;
+  }
+  if (!y || (u != str_len(want)) || byte_diff(y, u, want) || (s != skip)) fail(dotted);
+}
+
+static void check(void)
+{
+  unsigned int i;
+  char filler[32];
+
+  if (cache_init_wrapper(0, 4096, 0) != 1) _exit(111);
+
+  set(DNS_T_NS, "com", "ns.com");
+  set(DNS_T_NS, "example.com", "ns.example.com");
+  set(DNS_T_NS, "www.example.com", "");
+  set(DNS_T_A, "www.example.com", "1234");
+  set(DNS_T_NS, "example.org", "ns.example.org");
+
+  ancestor(DNS_T_NS, "a.b.example.com", 1, "ns.example.com", 2);
+  ancestor(DNS_T_NS, "EXAMPLE.com", 1, "ns.example.com", 0);
+  ancestor(DNS_T_NS, "x.www.example.com", 1, "ns.example.com", 2);
+  ancestor(DNS_T_NS, "x.www.example.com", 0, "", 1);
+  ancestor(DNS_T_NS, "other.com", 1, "ns.com", 1);
+  ancestor(DNS_T_NS, "example.net", 0, 0, 0);
+  ancestor(DNS_T_MX, "www.example.com", 0, 0, 0);
+  buffer_puts(buffer_1, "getancestor ok\n");
+
+  purge("Example.COM");
+  if (get(DNS_T_A, "www.example.com")) fail("purged www.example.com");
+  if (get(DNS_T_NS, "example.com")) fail("purged example.com");
+  ancestor(DNS_T_NS, "www.example.com", 0, "ns.com", 2);
+  ancestor(DNS_T_NS, "example.org", 1, "ns.example.org", 0);
+  set(DNS_T_NS, "example.com", "ns2.example.com");
+  ancestor(DNS_T_NS, "www.example.com", 1, "ns2.example.com", 1);
+  buffer_puts(buffer_1, "purge ok\n");
+
+  /*
+   * The nodes for zone and test.zone keep their labels in the key of the
+   * first entry. Once filler pushes it out and is written over it, they
+   * must have found them in the key of the second.
+   */
+  set(DNS_T_A, "a.test.zone", "first entry with some data to it");
+  set(DNS_T_A, "b.test.zone", "5678");
+  for (i = 0; get(DNS_T_A, "a.test.zone"); ++i) {
+    if (i == 1000) fail("a.test.zone never left");
+    byte_copy(filler, 7, "f00000.");
+    filler[1] += i / 10000 % 10;
+    filler[2] += i / 1000 % 10;
+    filler[3] += i / 100 % 10;
+    filler[4] += i / 10 % 10;
+    filler[5] += i % 10;
+    byte_copy(filler + 7, 5, "fill");
+    set(DNS_T_A, filler, "x");
+  }
+  if (!get(DNS_T_A, "b.test.zone")) fail("b.test.zone left too");
+  ancestor(DNS_T_A, "x.y.b.test.zone", 0, "5678", 2);
+  set(DNS_T_A, "c.test.zone", "9");
+  ancestor(DNS_T_A, "c.TEST.zone", 0, "9", 0);
+  purge("test.zone");
+  ancestor(DNS_T_A, "b.test.zone", 0, 0, 0);
+  ancestor(DNS_T_A, "c.test.zone", 0, 0, 0);
+  if (!get(DNS_T_A, filler)) fail("purge took filler");
+  buffer_puts(buffer_1, "eviction ok\n");
+}
+
 int main(int argc,char **argv)
 {
   int i;
@@ -14,6 +162,12 @@ int main(int argc,char **argv)
   unsigned int u;
   uint32 ttl;
 
+  if (argc < 2) {
+    check();
+    buffer_flush(buffer_1);
+    _exit(0);
+  }
+
   if (!cache_init_wrapper(1, 0, "cacheservers.list")) _exit(111);
 
   if (*argv) ++argv;
@@ -25,20 +179,27 @@ int main(int argc,char **argv)
         buffer_puts(buffer_1, "delete ");
         buffer_puts(buffer_1, x);
         buffer_puts(buffer_1,"\n");
-        cache_delete_wrapper(x, i);
+        cache_delete_wrapper(x, i, hashkey(x, i));
+      }
+      else if(str_equal(x + i + 1, "purge")) {
+        buffer_puts(buffer_1, "purge ");
+        buffer_puts(buffer_1, x);
+        buffer_puts(buffer_1,"\n");
+        x[i] = 0;
+        purge(x);
       }
       else {
         buffer_puts(buffer_1, "set ");
         buffer_puts(buffer_1, x);
         buffer_puts(buffer_1,"\n");
-        cache_set_wrapper(x, i, x + i + 1, str_len(x) - i - 1, 86400);
+        cache_set_wrapper(x, i, hashkey(x, i), x + i + 1, str_len(x) - i - 1, 86400);
       }
     }
     else {
       buffer_puts(buffer_1, "get ");
       buffer_puts(buffer_1, x);
       buffer_puts(buffer_1, " ");
-      y = cache_get_wrapper(x,i,&u,&ttl);
+      y = cache_get_wrapper(x,i,hashkey(x,i),&u,&ttl);
       if (y)
         buffer_put(buffer_1, y, u);
       buffer_puts(buffer_1,"\n");
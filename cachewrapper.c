@@ -1,32 +1,86 @@
+#include "alloc.h"
+#include "byte.h"
 #include "cache.h"
+#include "case.h"
+#include "dns.h"
 #include "distributedcache.h"
+#include "hash.h"
 #include "uint32.h"
 #include "uint64.h"
 
 static int usedistributedcache = 0;
 
-char *cache_get_wrapper(const char *key, unsigned int keylen, unsigned int *datalen, uint32 *ttl) {
+char *cache_get_wrapper(const char *key, unsigned int keylen, uint32 h, unsigned int *datalen, uint32 *ttl) {
   if(usedistributedcache) {
-    return distributed_cache_get(key, keylen, datalen, ttl);
+    return distributed_cache_get(key, keylen, h, datalen, ttl);
   }
   else {
-    return cache_get(key, keylen, datalen, ttl);
+    return cache_get(key, keylen, h, datalen, ttl);
   }
 }
 
-void cache_delete_wrapper(const char *key, unsigned int keylen) {
+void cache_delete_wrapper(const char *key, unsigned int keylen, uint32 h) {
   // delete not implemented for distributed cache
   if(!usedistributedcache) {
-    cache_delete(key, keylen);
+    cache_delete(key, keylen, h);
   }
 }
 
-void cache_set_wrapper(const char *key,unsigned int keylen,const char *data,unsigned int datalen,uint32 ttl) {
+/*
+ * The distributed cache has no label tree, so d and its ancestors are
+ * looked up one by one there, with the hashes in nh
+ */
+char *cache_getancestor_wrapper(const char type[2], const char *d, const struct namehash *nh, unsigned int minlen, unsigned int *skip, unsigned int *datalen, uint32 *ttl) {
+  char key[257];
+  unsigned int len;
+  unsigned int i;
+  unsigned int j;
+  char *cached;
+
+  if(!usedistributedcache) {
+    return cache_getancestor(type, d, minlen, skip, datalen, ttl);
+  }
+
+  len = dns_domain_length(d);
+  if(len > 255) {
+    return 0;
+  }
+  byte_copy(key, 2, type);
+  byte_copy(key + 2, len, d);
+  case_lowerb(key + 2, len);
+
+  for(i = 0;;++i) {
+    cached = distributed_cache_get(key, len + 2, hashtype(nh->suffix[i], type), datalen, ttl);
+    if(cached) {
+      if(*datalen >= minlen) {
+        *skip = i;
+        return cached;
+      }
+      alloc_free(cached);
+    }
+    if(!key[2]) {
+      break;
+    }
+    j = 1 + (unsigned char) key[2];
+    len -= j;
+    byte_copy(key + 2, len, key + 2 + j);
+  }
+  return 0;
+}
+
+void cache_purge_wrapper(const char *d) {
+  // purge not implemented for distributed cache
+  if(!usedistributedcache) {
+    cache_purge(d);
+  }
+}
+
+void cache_set_wrapper(const char *key,unsigned int keylen,uint32 h,const char *data,unsigned int datalen,uint32 ttl) {
   if(usedistributedcache) {
-    distributed_cache_set(key, keylen, data, datalen, ttl);
+    distributed_cache_set(key, keylen, h, data, datalen, ttl);
   }
   else {
-    cache_set(key, keylen, data, datalen, ttl);
+    cache_set(key, keylen, h, data, datalen, ttl);
   }
 }
 
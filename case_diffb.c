@@ -1,6 +1,7 @@
 #include "case.h"
+#include "x86cpu.h"
 
-int case_diffb(register const char *s,register unsigned int len,register const char *t)
+static int scalar(register const char *s,register unsigned int len,register const char *t)
 {
   register unsigned char x;
   register unsigned char y;
@@ -16,3 +17,83 @@ int case_diffb(register const char *s,register unsigned int len,register const c
   }
   return 0;
 }
+
+#ifdef __x86_64__
+
+/*
+ * Vector kernels find the first byte that differs after lowercasing, a
+ * whole block at a time; the scalar loop then orders that byte. Blocks
+ * never read past len: the last block overlaps the one before it.
+ * SSE2 is always there on x86-64, AVX2 is picked at run time.
+ */
+
+#include <immintrin.h>
+
+static unsigned int first16(const char *s,unsigned int len,const char *t)
+{
+  const __m128i a1 = _mm_set1_epi8('A' - 1);
+  const __m128i z1 = _mm_set1_epi8('Z' + 1);
+  const __m128i bit = _mm_set1_epi8(32);
+  __m128i x;
+  __m128i y;
+  unsigned int i = 0;
+  unsigned int m;
+
+  for (;;) {
+    if (i + 16 > len) i = len - 16;
+    x = _mm_loadu_si128((const __m128i *) (s + i));
+    y = _mm_loadu_si128((const __m128i *) (t + i));
+    x = _mm_or_si128(x,_mm_and_si128(bit,_mm_and_si128(_mm_cmpgt_epi8(x,a1),_mm_cmpgt_epi8(z1,x))));
+    y = _mm_or_si128(y,_mm_and_si128(bit,_mm_and_si128(_mm_cmpgt_epi8(y,a1),_mm_cmpgt_epi8(z1,y))));
+    m = _mm_movemask_epi8(_mm_cmpeq_epi8(x,y)) ^ 0xffff;
+    if (m) return i + __builtin_ctz(m);
+    i += 16;
+    if (i >= len) return len;
+  }
+}
+
+__attribute__((target("avx2")))
+static unsigned int first32(const char *s,unsigned int len,const char *t)
+{
+  const __m256i a1 = _mm256_set1_epi8('A' - 1);
+  const __m256i z1 = _mm256_set1_epi8('Z' + 1);
+  const __m256i bit = _mm256_set1_epi8(32);
+  __m256i x;
+  __m256i y;
+  unsigned int i = 0;
+  unsigned int m;
+
+  for (;;) {
+    if (i + 32 > len) i = len - 32;
+    x = _mm256_loadu_si256((const __m256i *) (s + i));
+    y = _mm256_loadu_si256((const __m256i *) (t + i));
+    x = _mm256_or_si256(x,_mm256_and_si256(bit,_mm256_and_si256(_mm256_cmpgt_epi8(x,a1),_mm256_cmpgt_epi8(z1,x))));
+    y = _mm256_or_si256(y,_mm256_and_si256(bit,_mm256_and_si256(_mm256_cmpgt_epi8(y,a1),_mm256_cmpgt_epi8(z1,y))));
+    m = ~(unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x,y));
+    if (m) return i + __builtin_ctz(m);
+    i += 32;
+    if (i >= len) return len;
+  }
+}
+
+int case_diffb(const char *s,unsigned int len,const char *t)
+{
+  unsigned int i;
+
+  if (len < 16) return scalar(s,len,t);
+  if ((len >= 32) && x86cpu_avx2())
+    i = first32(s,len,t);
+  else
+    i = first16(s,len,t);
+  if (i == len) return 0;
+  return scalar(s + i,1,t + i);
+}
+
+#else
+
+int case_diffb(const char *s,unsigned int len,const char *t)
+{
+  return scalar(s,len,t);
+}
+
+#endif
@@ -1,6 +1,7 @@
 #include "case.h"
+#include "x86cpu.h"
 
-void case_lowerb(char *s,unsigned int len)
+static void scalar(char *s,unsigned int len)
 {
   unsigned char x;
   while (len > 0) {
@@ -10,3 +11,62 @@ void case_lowerb(char *s,unsigned int len)
     ++s;
   }
 }
+
+#ifdef __x86_64__
+
+/* as in case_diffb.c; lowercasing twice is harmless, so blocks may overlap */
+
+#include <immintrin.h>
+
+static void lower16(char *s,unsigned int len)
+{
+  const __m128i a1 = _mm_set1_epi8('A' - 1);
+  const __m128i z1 = _mm_set1_epi8('Z' + 1);
+  const __m128i bit = _mm_set1_epi8(32);
+  __m128i x;
+  unsigned int i = 0;
+
+  for (;;) {
+    if (i + 16 > len) i = len - 16;
+    x = _mm_loadu_si128((const __m128i *) (s + i));
+    x = _mm_or_si128(x,_mm_and_si128(bit,_mm_and_si128(_mm_cmpgt_epi8(x,a1),_mm_cmpgt_epi8(z1,x))));
+    _mm_storeu_si128((__m128i *) (s + i),x);
+    i += 16;
+    if (i >= len) return;
+  }
+}
+
+__attribute__((target("avx2")))
+static void lower32(char *s,unsigned int len)
+{
+  const __m256i a1 = _mm256_set1_epi8('A' - 1);
+  const __m256i z1 = _mm256_set1_epi8('Z' + 1);
+  const __m256i bit = _mm256_set1_epi8(32);
+  __m256i x;
+  unsigned int i = 0;
+
+  for (;;) {
+    if (i + 32 > len) i = len - 32;
+    x = _mm256_loadu_si256((const __m256i *) (s + i));
+    x = _mm256_or_si256(x,_mm256_and_si256(bit,_mm256_and_si256(_mm256_cmpgt_epi8(x,a1),_mm256_cmpgt_epi8(z1,x))));
+    _mm256_storeu_si256((__m256i *) (s + i),x);
+    i += 32;
+    if (i >= len) return;
+  }
+}
+
+void case_lowerb(char *s,unsigned int len)
+{
+  if (len < 16) scalar(s,len);
+  else if ((len >= 32) && x86cpu_avx2()) lower32(s,len);
+  else lower16(s,len);
+}
+
+#else
+
+void case_lowerb(char *s,unsigned int len)
+{
+  scalar(s,len);
+}
+
+#endif
@@ -0,0 +1,169 @@
+#include "buffer.h"
+#include "byte.h"
+#include "case.h"
+#include "exit.h"
+#include "fmt.h"
+#include "scan.h"
+#include "taia.h"
+
+/*
+ * ./casetest [rounds]
+ * Checks case_diffb and case_lowerb against the byte-at-a-time loops
+ * they replaced, on random buffers, then times both versions.
+ */
+
+static int olddiffb(register const char *s,register unsigned int len,register const char *t)
+{
+  register unsigned char x;
+  register unsigned char y;
+
+  while (len > 0) {
+    --len;
+    x = *s++ - 'A';
+    if (x <= 'Z' - 'A') x += 'a'; else x += 'A';
+    y = *t++ - 'A';
+    if (y <= 'Z' - 'A') y += 'a'; else y += 'A';
+    if (x != y)
+      return ((int)(unsigned int) x) - ((int)(unsigned int) y);
+  }
+  return 0;
+}
+
+static void oldlowerb(char *s,unsigned int len)
+{
+  unsigned char x;
+  while (len > 0) {
+    --len;
+    x = *s - 'A';
+    if (x <= 'Z' - 'A') *s = x + 'a';
+    ++s;
+  }
+}
+
+static unsigned long seed = 1;
+
+static unsigned int rnd(unsigned int n)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return (seed >> 16) % n;
+}
+
+/* mostly letters, with the bytes next to 'A', 'Z', 'a', 'z' and high ones */
+static const char edge[] = "@AZ[`az{\200\301\332\377";
+
+static char rndbyte(void)
+{
+  switch(rnd(4)) {
+    case 0: return edge[rnd(sizeof edge - 1)];
+    case 1: return rnd(256);
+    default: return 'a' + rnd(26) - (rnd(2) ? 32 : 0);
+  }
+}
+
+static void put(const char *s,unsigned long u)
+{
+  char strnum[FMT_ULONG];
+
+  buffer_puts(buffer_1,s);
+  buffer_put(buffer_1,strnum,fmt_ulong(strnum,u));
+}
+
+static void fail(const char *what,unsigned int len,unsigned int pos)
+{
+  put(what,len);
+  put(" bytes, at ",pos);
+  buffer_puts(buffer_1,"\n");
+  buffer_flush(buffer_1);
+  _exit(111);
+}
+
+#define MAXLEN 300
+#define GUARD 40
+
+static char s[GUARD + MAXLEN + GUARD];
+static char t[GUARD + MAXLEN + GUARD];
+static char u[GUARD + MAXLEN + GUARD];
+
+static void check(void)
+{
+  unsigned int off;
+  unsigned int len;
+  unsigned int i;
+  int r;
+
+  off = GUARD - 8 + rnd(16);
+  len = rnd(4) ? rnd(80) : rnd(MAXLEN + 1);
+  for (i = 0;i < sizeof s;++i) s[i] = rndbyte();
+  byte_copy(t,sizeof t,s);
+  byte_copy(u,sizeof u,s);
+
+  oldlowerb(t + off,len);
+  case_lowerb(u + off,len);
+  for (i = 0;i < sizeof t;++i)
+    if (t[i] != u[i]) fail("case_lowerb differs on ",len,i);
+
+  /* t is s with some bytes flipped in case, or changed, in [off,off+len) */
+  byte_copy(t,sizeof t,s);
+  for (i = 0;i < len;++i)
+    if (!rnd(8)) t[off + i] ^= 32;
+  if (len && rnd(2))
+    t[off + rnd(len)] = rndbyte();
+
+  r = case_diffb(s + off,len,t + off);
+  if (r != olddiffb(s + off,len,t + off)) fail("case_diffb differs on ",len,off);
+  if (case_diffb(t + off,len,s + off) != -r) fail("case_diffb not antisymmetric on ",len,off);
+}
+
+static unsigned long loops;
+static volatile int sink;
+
+static void bench(unsigned int len)
+{
+  struct taia start;
+  struct taia stop;
+  unsigned long j;
+  int k;
+
+  put("len ",len);
+  for (k = 0;k < 4;++k) {
+    taia_now(&start);
+    for (j = 0;j < loops;++j)
+      switch(k) {
+        case 0: sink += olddiffb(s,len,t); break;
+        case 1: sink += case_diffb(s,len,t); break;
+        case 2: oldlowerb(u,len); u[0] = 'A'; break;
+        case 3: case_lowerb(u,len); u[0] = 'A'; break;
+      }
+    taia_now(&stop);
+    taia_sub(&stop,&stop,&start);
+    if (!(k & 1)) buffer_puts(buffer_1,k ? ", lowerb" : ": diffb");
+    put(k & 1 ? " new " : " old ",(unsigned long) (taia_approx(&stop) * 1e9 / loops));
+  }
+  buffer_puts(buffer_1," ns\n");
+}
+
+int main(int argc,char **argv)
+{
+  unsigned long rounds = 1000000;
+  unsigned long j;
+
+  if (argv[1]) scan_ulong(argv[1],&rounds);
+
+  for (j = 0;j < rounds;++j) check();
+  put("checked ",rounds);
+  buffer_puts(buffer_1," buffers\n");
+
+  /* equal up to the last byte, the usual case for names in the cache */
+  for (j = 0;j < sizeof s;++j) s[j] = t[j] = u[j] = 'a' + j % 26;
+  loops = rounds ? rounds : 1;
+  bench(8);
+  bench(16);
+  bench(40);
+  bench(64);
+  bench(255);
+
+  buffer_flush(buffer_1);
+  _exit(0);
+}
@@ -30,10 +30,19 @@ static struct CircularListNode* headauxillary = 0;
 static pthread_mutex_t hashmutex = PTHREAD_MUTEX_INITIALIZER;
 
 /*
+ * Servers and keys are placed on the ring by the same function, from the
+ * hash.h hash of the server entry and of the key respectively
+ * The hash is mixed first so that entries differing only in their last
+ * characters (ports, labels) still land far apart
  * Modulo division by a number independent of number of servers in the system
  */
-static unsigned int gethashposition(const char* key, int keylen) {
-  return hashcode(key, keylen) % HASH_MODULO;
+static unsigned int gethashposition(uint32 h) {
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h % HASH_MODULO;
 }
 
 /*
@@ -116,7 +125,7 @@ static struct CircularListNode* getnewservernode(const char *serverentry) {
     return 0;
   }
 
-  newnode->hashposition = gethashposition(serverentry, len);
+  newnode->hashposition = gethashposition(hashkey(serverentry, len));
   return newnode;
 }
 
@@ -196,15 +205,15 @@ void addserverstohashring(const char* cacheserverspath) {
 
 /*
  * Accesses critical section
- * Find server responsible for handling the given key
+ * Find server responsible for handling the key with hash h (see hash.h)
  * Return 1 on success, -1 on failure and set ip and port numbers to the server that should handle the key
  * The memory area pointed to by IP must be freed by the caller
  */
-int getserverforkey(const char* key, const int keylen, char** ip, uint16* port) {
-  if(!key || !port) {
+int getserverforhash(uint32 h, char** ip, uint16* port) {
+  if(!port) {
     return -1;
   }
-  int hashposition = gethashposition(key, keylen);
+  unsigned int hashposition = gethashposition(h);
 
   /*
    * Critical section
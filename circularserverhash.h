@@ -2,8 +2,9 @@
 #define CIRCULARSERVERHASH_H
 
 #include "uint16.h"
+#include "uint32.h"
 
 extern void addserverstohashring(const char*);
-extern int getserverforkey(const char*, const int, char**, uint16 *);
+extern int getserverforhash(uint32, char**, uint16 *);
 
 #endif
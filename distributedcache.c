@@ -21,7 +21,7 @@ static time_t lastmodificationtime = 0;
 /*
  * Extern entry point to set cache record for a given key
  */
-void distributed_cache_set(const char *key, unsigned int keylen, const char *data, const unsigned int datalen, uint32 ttl) {
+void distributed_cache_set(const char *key, unsigned int keylen, uint32 h, const char *data, const unsigned int datalen, uint32 ttl) {
   if(!initialized || keylen > DISTRIBUTED_MAXKEYLEN || datalen > DISTRIBUTED_MAXDATALEN || !ttl) {
     return;
   }
@@ -31,7 +31,7 @@ void distributed_cache_set(const char *key, unsigned int keylen, const char *dat
   }
   char* ip = 0;
   uint16 port;
-  if(getserverforkey(key, keylen, &ip, &port) == 1) {
+  if(getserverforhash(h, &ip, &port) == 1) {
     if(ip) {
       sendcachetoserver(ip, port, key, keylen, data, datalen, ttl);
       alloc_free(ip);
@@ -43,14 +43,14 @@ void distributed_cache_set(const char *key, unsigned int keylen, const char *dat
  * Extern entry point to get cache record for a given key
  * Return cache record on success, empty (0) on failure
  */
-char *distributed_cache_get(const char *key, const unsigned int keylen, unsigned int *datalen, uint32 *ttl) {
+char *distributed_cache_get(const char *key, const unsigned int keylen, uint32 h, unsigned int *datalen, uint32 *ttl) {
   if(!initialized || keylen > DISTRIBUTED_MAXKEYLEN) {
     return 0;
   }
 
   char* ip = 0;
   uint16 port;
-  if(getserverforkey(key, keylen, &ip, &port) == 1) {
+  if(getserverforhash(h, &ip, &port) == 1) {
     if(ip) {
       char* cached = getcachefromserver(ip, port, key, keylen, datalen, ttl);
       alloc_free(ip);
@@ -5,6 +5,8 @@
 #include "iopause.h"
 #include "taia.h"
 
+struct arena;
+
 #define DNS_C_IN "\0\1"
 #define DNS_C_ANY "\0\377"
 
@@ -20,9 +22,12 @@
 #define DNS_T_SIG "\0\30"
 #define DNS_T_KEY "\0\31"
 #define DNS_T_AAAA "\0\34"
+#define DNS_T_OPT "\0\51"
 #define DNS_T_AXFR "\0\374"
 #define DNS_T_ANY "\0\377"
 
+#define DNS_EDNS0_SIZE 1232 /* UDP payload size advertised by dns_transmit */
+
 struct dns_transmit {
   char *query; /* 0, or dynamically allocated */
   unsigned int querylen;
@@ -30,11 +35,18 @@ struct dns_transmit {
   unsigned int packetlen;
   int s1; /* 0, or 1 + an open file descriptor */
   int tcpstate;
+  int tcpreused; /* the TCP connection was already open */
+  unsigned int tcpconn; /* 0, or 1 + index of the shared TCP connection */
+  unsigned int tcpid; /* 0, or 1 + id of the query written on it */
   unsigned int udploop;
   unsigned int curserver;
   struct taia deadline;
+  struct taia sent; /* of the UDP query to curserver */
+  unsigned int hedge; /* 0, or 1 + index of the server to hedge with */
+  int hedged; /* the query has also gone to the hedge server */
+  struct taia hedgeat; /* when to send the hedge, or when it was sent */
   unsigned int pos;
-  const char *servers;
+  char servers[64]; /* fastest first */
   char localip[4];
   char qtype[2];
 } ;
@@ -44,8 +56,15 @@ extern unsigned int dns_random(unsigned int);
 
 extern void dns_sortip(char *,unsigned int);
 
+extern void dns_rtt_sample(const char *,unsigned int);
+extern void dns_rtt_timeout(const char *);
+extern unsigned int dns_rtt_rto(const char *);
+extern unsigned int dns_rtt_p90(const char *);
+extern void dns_rtt_sort(char *);
+
 extern void dns_domain_free(char **);
 extern int dns_domain_copy(char **,const char *);
+extern int dns_domain_acopy(struct arena *,char **,const char *);
 extern unsigned int dns_domain_length(const char *);
 extern int dns_domain_equal(const char *,const char *);
 extern int dns_domain_suffix(const char *,const char *);
@@ -55,10 +74,15 @@ extern int dns_domain_todot_cat(stralloc *,const char *);
 
 extern unsigned int dns_packet_copy(const char *,unsigned int,unsigned int,char *,unsigned int);
 extern unsigned int dns_packet_getname(const char *,unsigned int,unsigned int,char **);
+extern unsigned int dns_packet_name(const char *,unsigned int,unsigned int,char *);
 extern unsigned int dns_packet_skipname(const char *,unsigned int,unsigned int);
+extern unsigned int dns_packet_edns0(const char *,unsigned int,unsigned int);
 
 extern int dns_transmit_start(struct dns_transmit *,const char *,int,const char *,const char *,const char *);
 extern void dns_transmit_free(struct dns_transmit *);
+extern int dns_transmit_pool(const char *,unsigned int);
+extern void dns_transmit_hedge(unsigned int);
+extern void dns_transmit_refill(void);
 extern void dns_transmit_io(struct dns_transmit *,iopause_fd *,struct taia *);
 extern int dns_transmit_get(struct dns_transmit *,const iopause_fd *,const struct taia *);
 
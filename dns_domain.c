@@ -1,5 +1,6 @@
 #include "error.h"
 #include "alloc.h"
+#include "arena.h"
 #include "case.h"
 #include "byte.h"
 #include "dns.h"
@@ -37,6 +38,20 @@ int dns_domain_copy(char **out,const char *in)
   return 1;
 }
 
+/* like dns_domain_copy, but *out dies with the arena and is never freed */
+int dns_domain_acopy(struct arena *a,char **out,const char *in)
+{
+  unsigned int len;
+  char *x;
+
+  len = dns_domain_length(in);
+  x = arena_alloc(a,len);
+  if (!x) return 0;
+  byte_copy(x,len,in);
+  *out = x;
+  return 1;
+}
+
 int dns_domain_equal(const char *dn1,const char *dn2)
 {
   unsigned int len;
@@ -48,27 +63,38 @@ int dns_domain_equal(const char *dn1,const char *dn2)
   return 1;
 }
 
-int dns_domain_suffix(const char *big,const char *little)
+/*
+ * Skip labels of big until what is left is as long as little, then compare
+ * once; case_diffb does the comparison a block at a time
+ */
+static const char *suffix(const char *big,const char *little)
 {
+  unsigned int biglen;
+  unsigned int len;
   unsigned char c;
 
-  for (;;) {
-    if (dns_domain_equal(big,little)) return 1;
-    c = *big++;
-    if (!c) return 0;
-    big += c;
+  biglen = dns_domain_length(big);
+  len = dns_domain_length(little);
+  while (biglen > len) {
+    c = *big;
+    big += 1 + (unsigned int) c;
+    biglen -= 1 + (unsigned int) c;
   }
+  if (biglen != len) return 0;
+  if (case_diffb(big,len,little)) return 0;
+  return big;
+}
+
+int dns_domain_suffix(const char *big,const char *little)
+{
+  return suffix(big,little) != 0;
 }
 
 unsigned int dns_domain_suffixpos(const char *big,const char *little)
 {
-  const char *orig = big;
-  unsigned char c;
+  const char *x;
 
-  for (;;) {
-    if (dns_domain_equal(big,little)) return big - orig;
-    c = *big++;
-    if (!c) return 0;
-    big += c;
-  }
+  x = suffix(big,little);
+  if (!x) return 0;
+  return x - big;
 }
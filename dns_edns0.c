@@ -0,0 +1,48 @@
+#include "byte.h"
+#include "uint16.h"
+#include "dns.h"
+
+/*
+pos is the position just past the question of buf
+Return the UDP payload size advertised by an OPT record in the additional
+section, at least 512; 0 if there is no OPT record or buf is unparseable
+*/
+unsigned int dns_packet_edns0(const char *buf,unsigned int len,unsigned int pos)
+{
+  char header[12];
+  char misc[10];
+  unsigned int skip;
+  uint16 numglue;
+  uint16 num;
+  uint16 size;
+  int root;
+
+  if (!dns_packet_copy(buf,len,0,header,12)) return 0;
+  uint16_unpack_big(header + 6,&num);
+  skip = num;
+  uint16_unpack_big(header + 8,&num);
+  skip += num;
+  uint16_unpack_big(header + 10,&numglue);
+
+  while (skip--) {
+    pos = dns_packet_skipname(buf,len,pos); if (!pos) return 0;
+    pos = dns_packet_copy(buf,len,pos,misc,10); if (!pos) return 0;
+    uint16_unpack_big(misc + 8,&num);
+    pos += num;
+  }
+
+  while (numglue--) {
+    if (pos >= len) return 0;
+    root = !buf[pos];
+    pos = dns_packet_skipname(buf,len,pos); if (!pos) return 0;
+    pos = dns_packet_copy(buf,len,pos,misc,10); if (!pos) return 0;
+    if (root && byte_equal(misc,2,DNS_T_OPT)) {
+      uint16_unpack_big(misc + 2,&size);
+      return (size < 512) ? 512 : size;
+    }
+    uint16_unpack_big(misc + 8,&num);
+    pos += num;
+  }
+
+  return 0;
+}
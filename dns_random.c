@@ -3,10 +3,11 @@
 #include "taia.h"
 #include "uint32.h"
 
-static uint32 seed[32];
-static uint32 in[12];
-static uint32 out[8];
-static int outleft = 0;
+/* per thread; each thread calls dns_random_init before dns_random */
+static __thread uint32 seed[32];
+static __thread uint32 in[12];
+static __thread uint32 out[8];
+static __thread int outleft = 0;
 
 #define ROTATE(x,b) (((x) << (b)) | ((x) >> (32 - (b))))
 #define MUSH(i,b) x = t[i] += (((x ^ seed[i]) + sum) ^ ROTATE(x,b));
@@ -0,0 +1,185 @@
+#include <pthread.h>
+#include "byte.h"
+#include "taia.h"
+#include "uint64.h"
+#include "dns.h"
+
+/*
+Smoothed round-trip time and its variance per server address, shared by
+all threads, in microseconds as in RFC 6298. Consecutive timeouts push a
+server back in the order without touching its estimate; the next answer
+clears them. An entry not updated for RTT_EXPIRE seconds is forgotten, so
+the server gets measured afresh.
+*/
+
+#define RTT_SLOTS 1024 /* power of 2 */
+#define RTT_PROBE 8
+#define RTT_EXPIRE 900
+#define RTT_INIT 400000 /* srtt assumed for an unknown server */
+#define RTT_MINRTO 50000
+#define RTT_MAXRTO 3000000
+#define RTT_MINHEDGE 10000
+#define RTT_EXPLORE 16 /* one order in RTT_EXPLORE ignores the estimates */
+
+static struct rtt {
+  char ip[4];
+  unsigned int srtt;
+  unsigned int rttvar;
+  unsigned int timeouts;
+  uint64 when;
+} rtt[RTT_SLOTS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64 now(void)
+{
+  struct taia t;
+  taia_now(&t);
+  return t.sec.x;
+}
+
+static unsigned int hash(const char ip[4])
+{
+  unsigned int h;
+
+  h = (unsigned char) ip[0];
+  h = (h << 8) + (unsigned char) ip[1];
+  h = (h << 8) + (unsigned char) ip[2];
+  h = (h << 8) + (unsigned char) ip[3];
+  h *= 2654435761U;
+  return h >> 22;
+}
+
+/* with lock held; 0 if ip is unknown and flagcreate is 0 */
+static struct rtt *find(const char ip[4],uint64 t,int flagcreate)
+{
+  struct rtt *x;
+  struct rtt *old = 0;
+  unsigned int h;
+  unsigned int i;
+
+  h = hash(ip);
+  for (i = 0;i < RTT_PROBE;++i) {
+    x = rtt + ((h + i) & (RTT_SLOTS - 1));
+    if (x->when + RTT_EXPIRE < t) {
+      if (!old || (old->when + RTT_EXPIRE >= t)) old = x;
+      continue;
+    }
+    if (byte_equal(x->ip,4,ip)) return x;
+    if (!old || (x->when < old->when)) old = x;
+  }
+  if (!flagcreate) return 0;
+
+  byte_copy(old->ip,4,ip);
+  old->srtt = RTT_INIT;
+  old->rttvar = RTT_INIT * 3 / 8;
+  old->timeouts = 0;
+  old->when = t;
+  return old;
+}
+
+void dns_rtt_sample(const char ip[4],unsigned int usec)
+{
+  struct rtt *x;
+  unsigned int err;
+  uint64 t = now();
+
+  pthread_mutex_lock(&lock);
+  x = find(ip,t,0);
+  if (!x || x->timeouts) {
+    x = find(ip,t,1);
+    x->srtt = usec;
+    x->rttvar = usec / 2;
+    x->timeouts = 0;
+  }
+  else {
+    err = (usec > x->srtt) ? usec - x->srtt : x->srtt - usec;
+    x->rttvar = x->rttvar - x->rttvar / 4 + err / 4;
+    x->srtt = x->srtt - x->srtt / 8 + usec / 8;
+  }
+  x->when = t;
+  pthread_mutex_unlock(&lock);
+}
+
+void dns_rtt_timeout(const char ip[4])
+{
+  struct rtt *x;
+  uint64 t = now();
+
+  pthread_mutex_lock(&lock);
+  x = find(ip,t,1);
+  if (x->timeouts < 10) ++x->timeouts;
+  x->when = t;
+  pthread_mutex_unlock(&lock);
+}
+
+/* retransmission timeout in microseconds */
+unsigned int dns_rtt_rto(const char ip[4])
+{
+  struct rtt *x;
+  unsigned int rto = RTT_INIT + 4 * (RTT_INIT * 3 / 8);
+
+  pthread_mutex_lock(&lock);
+  x = find(ip,now(),0);
+  if (x) rto = x->srtt + 4 * x->rttvar;
+  pthread_mutex_unlock(&lock);
+
+  if (rto < RTT_MINRTO) rto = RTT_MINRTO;
+  if (rto > RTT_MAXRTO) rto = RTT_MAXRTO;
+  return rto;
+}
+
+/* time in microseconds within which nine answers in ten arrive */
+unsigned int dns_rtt_p90(const char ip[4])
+{
+  struct rtt *x;
+  unsigned int p90 = RTT_INIT + 2 * (RTT_INIT * 3 / 8);
+
+  pthread_mutex_lock(&lock);
+  x = find(ip,now(),0);
+  if (x) p90 = x->srtt + 2 * x->rttvar;
+  pthread_mutex_unlock(&lock);
+
+  if (p90 < RTT_MINHEDGE) p90 = RTT_MINHEDGE;
+  return p90;
+}
+
+/*
+Order the servers fastest first, each timeout counting as doubling the
+time; unknown servers count as RTT_INIT, empty entries go last. The sort
+is stable, so equal servers keep the caller's random order. To keep the
+estimates fresh, one order in RTT_EXPLORE only moves servers that timed
+out to the back.
+*/
+void dns_rtt_sort(char servers[64])
+{
+  unsigned int key[16];
+  struct rtt *x;
+  uint64 t;
+  unsigned int i;
+  unsigned int j;
+  unsigned int k;
+  int explore;
+  char ip[4];
+
+  explore = !dns_random(RTT_EXPLORE);
+  t = now();
+  pthread_mutex_lock(&lock);
+  for (i = 0;i < 16;++i) {
+    if (byte_equal(servers + 4 * i,4,"\0\0\0\0")) { key[i] = -1; continue; }
+    x = find(servers + 4 * i,t,0);
+    key[i] = (x && !explore) ? x->srtt : RTT_INIT;
+    if (x) if (x->timeouts) key[i] = (key[i] > (0x7fffffffU >> x->timeouts)) ? 0x7fffffffU : key[i] << x->timeouts;
+  }
+  pthread_mutex_unlock(&lock);
+
+  for (i = 1;i < 16;++i) {
+    k = key[i];
+    byte_copy(ip,4,servers + 4 * i);
+    for (j = i;j && (key[j - 1] > k);--j) {
+      key[j] = key[j - 1];
+      byte_copy(servers + 4 * j,4,servers + 4 * (j - 1));
+    }
+    key[j] = k;
+    byte_copy(servers + 4 * j,4,ip);
+  }
+}
@@ -29,10 +29,28 @@ static int serverfailed(const char *buf,unsigned int len)
   return 0;
 }
 
+/* the server did not understand the OPT record; ask again without it */
+static int ednsrejected(struct dns_transmit *d,const char *buf,unsigned int len)
+{
+  char out[12];
+  unsigned int rcode;
+
+  if (!d->query[13]) return 0;
+  if (!dns_packet_copy(buf,len,0,out,12)) return 0;
+  rcode = out[3];
+  rcode &= 15;
+  if ((rcode != 1) && (rcode != 4)) return 0;
+
+  d->querylen -= 11;
+  d->query[13] = 0;
+  uint16_pack_big(d->query,d->querylen - 2);
+  return 1;
+}
+
 static int irrelevant(const struct dns_transmit *d,const char *buf,unsigned int len)
 {
   char out[12];
-  char *dn;
+  char dn[255];
   unsigned int pos;
 
   pos = dns_packet_copy(buf,len,0,out,12); if (!pos) return 1;
@@ -40,10 +58,8 @@ static int irrelevant(const struct dns_transmit *d,const char *buf,unsigned int
   if (out[4] != 0) return 1;
   if (out[5] != 1) return 1;
 
-  dn = 0;
-  pos = dns_packet_getname(buf,len,pos,&dn); if (!pos) return 1;
-  if (!dns_domain_equal(dn,d->query + 14)) { alloc_free(dn); return 1; }
-  alloc_free(dn);
+  pos = dns_packet_name(buf,len,pos,dn); if (!pos) return 1;
+  if (!dns_domain_equal(dn,d->query + 14)) return 1;
 
   pos = dns_packet_copy(buf,len,pos,out,4); if (!pos) return 1;
   if (byte_diff(out,2,d->qtype)) return 1;
@@ -66,9 +82,26 @@ static void queryfree(struct dns_transmit *d)
   d->query = 0;
 }
 
+/*
+UDP sockets bound to random ports on one local address, kept per thread
+so that a transmission does not pay for socket and bind. A socket is
+handed out at random for one transmission and closed when it is done,
+so no port outlives the query it was picked for; dns_transmit_refill
+binds replacements on fresh random ports between events. Queries go out
+with sendto, and replies are only accepted from the address and port
+they were sent to.
+*/
+static __thread int *pool;
+static __thread unsigned int poolnum;
+static __thread unsigned int poolmax;
+static __thread char poolip[4];
+
+static void tcpleave(struct dns_transmit *);
+
 static void socketfree(struct dns_transmit *d)
 {
   if (!d->s1) return;
+  if (d->tcpconn) { tcpleave(d); return; }
   close(d->s1 - 1);
   d->s1 = 0;
 }
@@ -80,20 +113,140 @@ void dns_transmit_free(struct dns_transmit *d)
   packetfree(d);
 }
 
-static int randombind(struct dns_transmit *d)
+static int randombind(int s,char localip[4])
 {
   int j;
 
   for (j = 0;j < 10;++j)
-    if (socket_bind4(d->s1 - 1,d->localip,1025 + dns_random(64510)) == 0)
+    if (socket_bind4(s,localip,1025 + dns_random(64510)) == 0)
       return 0;
-  if (socket_bind4(d->s1 - 1,d->localip,0) == 0)
+  if (socket_bind4(s,localip,0) == 0)
     return 0;
   return -1;
 }
 
+/* top the pool up to its size */
+void dns_transmit_refill(void)
+{
+  int s;
+
+  while (poolnum < poolmax) {
+    s = socket_udp();
+    if (s == -1) return;
+    if (randombind(s,poolip) == -1) { close(s); return; }
+    pool[poolnum] = s;
+    ++poolnum;
+  }
+}
+
+/*
+Keep up to n sockets bound to localip for this thread
+Return 0 on success, -1 on failure
+*/
+int dns_transmit_pool(const char localip[4],unsigned int n)
+{
+  pool = (int *) alloc(n * sizeof(int));
+  if (!pool) return -1;
+  byte_copy(poolip,4,localip);
+  poolnum = 0;
+  poolmax = n;
+  dns_transmit_refill();
+  return 0;
+}
+
+/* a UDP socket from the pool, with whatever arrived while it sat there discarded, or a new one */
+static int udpsocket(struct dns_transmit *d)
+{
+  char ch;
+  unsigned int i;
+
+  d->tcpstate = 0;
+  if (poolnum && byte_equal(d->localip,4,poolip)) {
+    i = dns_random(poolnum);
+    d->s1 = 1 + pool[i];
+    pool[i] = pool[--poolnum];
+    while (recv(d->s1 - 1,&ch,1,0) != -1) ;
+    return 0;
+  }
+
+  d->s1 = 1 + socket_udp();
+  if (!d->s1) return -1;
+  return randombind(d->s1 - 1,d->localip);
+}
+
+/* of the server's retransmission timeout, for each round through the servers */
 static const int timeouts[4] = { 1, 3, 11, 45 };
 
+static void later(struct taia *t,const struct taia *from,unsigned int usec)
+{
+  t->sec.x = usec / 1000000; /* XXX: breaks tai encapsulation */
+  t->nano = (usec % 1000000) * 1000;
+  t->atto = 0;
+  taia_add(t,t,from);
+}
+
+/*
+Hedging: when the server asked over UDP has not answered within its 90th
+percentile RTT, the same query also goes to the next server in the list,
+from the same socket, and whichever answers first is taken. Every UDP
+query earns hedgepercent credits and a hedge costs 100, with at most
+HEDGEBURST hedges saved up, so hedges stay near hedgepercent of the
+queries sent. The credits are shared by all threads.
+*/
+#define HEDGEBURST 50
+
+static unsigned int hedgepercent;
+static int hedgecredit;
+
+void dns_transmit_hedge(unsigned int percent)
+{
+  if (percent > 100) percent = 100;
+  hedgepercent = percent;
+}
+
+static int hedgetake(void)
+{
+  int c;
+
+  for (;;) {
+    c = hedgecredit;
+    if (c < 100) return 0;
+    if (__sync_bool_compare_and_swap(&hedgecredit,c,c - 100)) return 1;
+  }
+}
+
+/* plan a hedge for the query just sent to curserver, if there is another server */
+static void hedgeplan(struct dns_transmit *d)
+{
+  unsigned int i;
+
+  d->hedge = 0;
+  d->hedged = 0;
+  if (!hedgepercent) return;
+  if (hedgecredit < 100 * HEDGEBURST) __sync_add_and_fetch(&hedgecredit,hedgepercent);
+
+  for (i = d->curserver + 1;i < 16;++i)
+    if (byte_diff(d->servers + 4 * i,4,"\0\0\0\0")) {
+      d->hedge = 1 + i;
+      later(&d->hedgeat,&d->sent,dns_rtt_p90(d->servers + 4 * d->curserver));
+      if (!taia_less(&d->hedgeat,&d->deadline)) d->hedge = 0;
+      return;
+    }
+}
+
+static void hedgesend(struct dns_transmit *d)
+{
+  const char *ip = d->servers + 4 * (d->hedge - 1);
+
+  if (hedgetake())
+    if (socket_send4(d->s1 - 1,d->query + 2,d->querylen - 2,ip,53) == d->querylen - 2) {
+      d->hedged = 1;
+      taia_now(&d->hedgeat);
+      return;
+    }
+  d->hedge = 0;
+}
+
 static int thisudp(struct dns_transmit *d)
 {
   const char *ip;
@@ -107,19 +260,14 @@ static int thisudp(struct dns_transmit *d)
 	d->query[2] = dns_random(256);
 	d->query[3] = dns_random(256);
   
-        d->s1 = 1 + socket_udp();
-        if (!d->s1) { dns_transmit_free(d); return -1; }
-	if (randombind(d) == -1) { dns_transmit_free(d); return -1; }
-
-        if (socket_connect4(d->s1 - 1,ip,53) == 0)
-          if (send(d->s1 - 1,d->query + 2,d->querylen - 2,0) == d->querylen - 2) {
-            struct taia now;
-            taia_now(&now);
-            taia_uint(&d->deadline,timeouts[d->udploop]);
-            taia_add(&d->deadline,&d->deadline,&now);
-            d->tcpstate = 0;
-            return 0;
-          }
+        if (udpsocket(d) == -1) { dns_transmit_free(d); return -1; }
+
+        if (socket_send4(d->s1 - 1,d->query + 2,d->querylen - 2,ip,53) == d->querylen - 2) {
+          taia_now(&d->sent);
+          later(&d->deadline,&d->sent,dns_rtt_rto(ip) * timeouts[d->udploop]);
+          hedgeplan(d);
+          return 0;
+        }
   
         socketfree(d);
       }
@@ -144,6 +292,245 @@ static int nextudp(struct dns_transmit *d)
   return thisudp(d);
 }
 
+/*
+Upstream TCP connections are shared by the transmissions of a thread. A
+connection carries up to TCPPIPELINE queries at once, each with an id
+that is unique on it, and the server may answer them in any order. An
+event loop registers a descriptor for one owner, so every transmission
+on a connection polls its own dup of it. Queries are written one at a
+time. Whichever transmission is woken reads the length and id of the
+next answer; the transmission with that id reads the rest, and answers
+for transmissions that went away are read and thrown away.
+
+Dups are only closed together with their connection, so no epoll
+registration outlives the descriptor it was made for. A connection
+without transmissions stays open for TCPIDLE seconds, at most TCPCONNS
+of them, and is checked for EOF or stray data before it is used again.
+If a connection that was already open fails before the answer starts,
+the query is tried again on a new connection to the same server, since
+the server may simply have closed it.
+*/
+#define TCPPIPELINE 8
+#define TCPCONNS 32
+#define TCPIDLE 10
+#define TCPORPHAN 0x10000 /* in pending: nobody waits for the answer */
+#define TCPDISCARD 0x20000 /* as reader: the answer is thrown away */
+
+static __thread struct tcpconn {
+  int fd; /* -1 if the slot is free */
+  char ip[4];
+  char localip[4];
+  int connected;
+  int broken; /* shut down; closed when the last transmission leaves */
+  unsigned int users;
+  int spare[TCPPIPELINE]; /* dups not in use */
+  unsigned int spares;
+  unsigned int pending[TCPPIPELINE]; /* 1 + id of each unanswered query */
+  unsigned int npending;
+  unsigned int orphans;
+  unsigned int writer; /* 0, or 1 + id of a query partly written */
+  unsigned int reader; /* 0, 1 + id of the answer being read, or TCPDISCARD */
+  unsigned int skip; /* bytes left of the answer being thrown away */
+  char head[4]; /* length and id of the next answer */
+  unsigned int headlen;
+  struct taia idle; /* since */
+} *tcpconn;
+static __thread unsigned int tcpconns;
+
+static void tcpclose(struct tcpconn *c)
+{
+  while (c->spares) close(c->spare[--c->spares]);
+  close(c->fd);
+  c->fd = -1;
+}
+
+static void tcpbreak(struct tcpconn *c)
+{
+  shutdown(c->fd,SHUT_RDWR);
+  c->broken = 1;
+}
+
+static unsigned int tcpfind(struct tcpconn *c,unsigned int id)
+{
+  unsigned int i;
+
+  for (i = 0;i < c->npending;++i)
+    if ((c->pending[i] & ~TCPORPHAN) == id) break;
+  return i;
+}
+
+static void tcpanswered(struct tcpconn *c,unsigned int i)
+{
+  if (c->pending[i] & TCPORPHAN) --c->orphans;
+  c->pending[i] = c->pending[--c->npending];
+}
+
+/* close idle connections past TCPIDLE, and the longest idle past TCPCONNS */
+static void tcpexpire(void)
+{
+  struct taia now;
+  struct taia expire;
+  struct tcpconn *oldest;
+  unsigned int idle;
+  unsigned int i;
+
+  taia_now(&now);
+  do {
+    idle = 0;
+    oldest = 0;
+    for (i = 0;i < tcpconns;++i) {
+      if ((tcpconn[i].fd == -1) || tcpconn[i].users) continue;
+      taia_uint(&expire,TCPIDLE);
+      taia_add(&expire,&expire,&tcpconn[i].idle);
+      if (taia_less(&expire,&now)) { tcpclose(tcpconn + i); continue; }
+      ++idle;
+      if (!oldest || taia_less(&tcpconn[i].idle,&oldest->idle)) oldest = tcpconn + i;
+    }
+    if (idle > TCPCONNS) tcpclose(oldest);
+  } while (idle > TCPCONNS);
+}
+
+/* a connection to ip from localip with room for one more query, or 0 */
+static struct tcpconn *tcpshared(const char ip[4],const char localip[4])
+{
+  struct tcpconn *c;
+  unsigned int i;
+  char ch;
+
+  for (i = 0;i < tcpconns;++i) {
+    c = tcpconn + i;
+    if ((c->fd == -1) || c->broken) continue;
+    if (byte_diff(c->ip,4,ip) || byte_diff(c->localip,4,localip)) continue;
+    if (c->users + c->orphans >= TCPPIPELINE) continue;
+    if (!c->users) {
+      if (recv(c->fd,&ch,1,MSG_PEEK) == -1)
+        if ((errno == error_again) || (errno == error_wouldblock))
+          return c;
+      tcpclose(c); /* closed by the server, or out of step */
+      continue;
+    }
+    return c;
+  }
+  return 0;
+}
+
+/* a free slot in tcpconn, or 0 */
+static struct tcpconn *tcpslot(void)
+{
+  struct tcpconn *c;
+  unsigned int i;
+  unsigned int n;
+
+  for (i = 0;i < tcpconns;++i)
+    if (tcpconn[i].fd == -1) return tcpconn + i;
+
+  n = tcpconns ? 2 * tcpconns : TCPCONNS;
+  c = (struct tcpconn *) alloc(n * sizeof(struct tcpconn));
+  if (!c) return 0;
+  byte_copy(c,tcpconns * sizeof(struct tcpconn),tcpconn);
+  if (tcpconn) alloc_free(tcpconn);
+  tcpconn = c;
+  for (i = tcpconns;i < n;++i) tcpconn[i].fd = -1;
+  i = tcpconns;
+  tcpconns = n;
+  return tcpconn + i;
+}
+
+/*
+put d on a connection to ip, sharing one if possible
+Return 0 on success, 1 if the server cannot be reached, -1 on failure
+*/
+static int tcpjoin(struct dns_transmit *d,const char ip[4])
+{
+  struct tcpconn *c;
+  int fd;
+
+  tcpexpire();
+  c = tcpshared(ip,d->localip);
+  if (c)
+    d->tcpreused = c->connected;
+  else {
+    d->tcpreused = 0;
+    c = tcpslot();
+    if (!c) return -1;
+    fd = socket_tcp();
+    if (fd == -1) return -1;
+    if (randombind(fd,d->localip) == -1) { close(fd); return -1; }
+    if (socket_connect4(fd,ip,53) == 0)
+      c->connected = 1;
+    else if ((errno == error_inprogress) || (errno == error_wouldblock))
+      c->connected = 0;
+    else { close(fd); return 1; }
+    c->fd = fd;
+    byte_copy(c->ip,4,ip);
+    byte_copy(c->localip,4,d->localip);
+    c->broken = 0;
+    c->users = 0;
+    c->spares = 0;
+    c->npending = 0;
+    c->orphans = 0;
+    c->writer = 0;
+    c->reader = 0;
+    c->headlen = 0;
+  }
+
+  fd = c->spares ? c->spare[--c->spares] : dup(c->fd);
+  if (fd == -1) {
+    if (!c->users) tcpclose(c);
+    return -1;
+  }
+  ++c->users;
+  d->s1 = 1 + fd;
+  d->tcpconn = 1 + (c - tcpconn);
+  d->tcpid = 0;
+  d->tcpstate = c->connected ? 2 : 1;
+  d->pos = 0;
+  return 0;
+}
+
+/* take d off its connection, leaving its answer, if any, to be thrown away */
+static void tcpleave(struct dns_transmit *d)
+{
+  struct tcpconn *c = tcpconn + d->tcpconn - 1;
+  unsigned int i;
+  uint16 len;
+
+  if (d->tcpid) {
+    if (c->writer == d->tcpid)
+      tcpbreak(c); /* half a query on the wire */
+    else {
+      i = tcpfind(c,d->tcpid);
+      if (i < c->npending) {
+        if (c->reader != d->tcpid) {
+          c->pending[i] |= TCPORPHAN;
+          ++c->orphans;
+        }
+        else {
+          if (c->headlen == 4) { /* not claimed yet */
+            uint16_unpack_big(c->head,&len);
+            c->skip = len - 2;
+            c->headlen = 0;
+          }
+          else
+            c->skip = d->packetlen - d->pos;
+          c->reader = c->skip ? TCPDISCARD : 0;
+          tcpanswered(c,i);
+        }
+      }
+    }
+  }
+
+  c->spare[c->spares++] = d->s1 - 1;
+  d->s1 = 0;
+  d->tcpconn = 0;
+  d->tcpid = 0;
+  if (--c->users) return;
+  if (c->broken || c->npending || c->reader || c->headlen)
+    tcpclose(c);
+  else
+    taia_now(&c->idle);
+}
+
 static int thistcp(struct dns_transmit *d)
 {
   struct taia now;
@@ -155,26 +542,15 @@ static int thistcp(struct dns_transmit *d)
   for (;d->curserver < 16;++d->curserver) {
     ip = d->servers + 4 * d->curserver;
     if (byte_diff(ip,4,"\0\0\0\0")) {
-      d->query[2] = dns_random(256);
-      d->query[3] = dns_random(256);
-
-      d->s1 = 1 + socket_tcp();
-      if (!d->s1) { dns_transmit_free(d); return -1; }
-      if (randombind(d) == -1) { dns_transmit_free(d); return -1; }
-  
       taia_now(&now);
       taia_uint(&d->deadline,10);
       taia_add(&d->deadline,&d->deadline,&now);
-      if (socket_connect4(d->s1 - 1,ip,53) == 0) {
-        d->tcpstate = 2;
-        return 0;
-      }
-      if ((errno == error_inprogress) || (errno == error_wouldblock)) {
-        d->tcpstate = 1;
-        return 0;
+
+      d->tcpstate = 1;
+      switch(tcpjoin(d,ip)) {
+        case 0: return 0;
+        case -1: dns_transmit_free(d); return -1;
       }
-  
-      socketfree(d);
     }
   }
 
@@ -193,6 +569,69 @@ static int nexttcp(struct dns_transmit *d)
   return thistcp(d);
 }
 
+/* the connection broke before any of the answer arrived */
+static int failtcp(struct dns_transmit *d)
+{
+  tcpbreak(tcpconn + d->tcpconn - 1);
+  if (d->tcpreused) return thistcp(d);
+  return nexttcp(d);
+}
+
+/*
+read the next answers on d's connection until one is d's
+Return 1 when d has the length of its answer, 0 to wait, -1 if the connection broke
+*/
+static int tcphead(struct dns_transmit *d)
+{
+  struct tcpconn *c = tcpconn + d->tcpconn - 1;
+  char buf[512];
+  uint16 len;
+  uint16 id;
+  unsigned int i;
+  int fd = d->s1 - 1;
+  int r;
+
+  for (;;) {
+    if (c->broken) return -1;
+
+    if (c->reader == TCPDISCARD) {
+      r = read(fd,buf,c->skip < sizeof buf ? c->skip : sizeof buf);
+      if (r == -1) if ((errno == error_again) || (errno == error_wouldblock)) return 0;
+      if (r <= 0) { tcpbreak(c); return -1; }
+      c->skip -= r;
+      if (!c->skip) c->reader = 0;
+      continue;
+    }
+
+    if (c->reader) {
+      if (c->reader != d->tcpid) return 0; /* another transmission's answer */
+      uint16_unpack_big(c->head,&len);
+      d->packetlen = len;
+      c->headlen = 0;
+      return 1;
+    }
+
+    r = read(fd,c->head + c->headlen,4 - c->headlen);
+    if (r == -1) if ((errno == error_again) || (errno == error_wouldblock)) return 0;
+    if (r <= 0) { tcpbreak(c); return -1; }
+    c->headlen += r;
+    if (c->headlen < 4) return 0;
+
+    uint16_unpack_big(c->head,&len);
+    uint16_unpack_big(c->head + 2,&id);
+    i = tcpfind(c,1 + id);
+    if ((len < 12) || (i == c->npending)) { tcpbreak(c); return -1; }
+    if (c->pending[i] & TCPORPHAN) {
+      c->reader = TCPDISCARD;
+      c->skip = len - 2;
+      c->headlen = 0;
+      tcpanswered(c,i);
+    }
+    else
+      c->reader = c->pending[i];
+  }
+}
+
 int dns_transmit_start(struct dns_transmit *d,const char servers[64],int flagrecursive,const char *q,const char qtype[2],const char localip[4])
 {
   unsigned int len;
@@ -201,18 +640,24 @@ int dns_transmit_start(struct dns_transmit *d,const char servers[64],int flagrec
   errno = error_io;
 
   len = dns_domain_length(q);
-  d->querylen = len + 18;
+  d->querylen = len + 29;
   d->query = alloc(d->querylen);
   if (!d->query) return -1;
 
-  uint16_pack_big(d->query,len + 16);
-  byte_copy(d->query + 2,12,flagrecursive ? "\0\0\1\0\0\1\0\0\0\0\0\0" : "\0\0\0\0\0\1\0\0\0\0\0\0gcc-bug-workaround");
+  uint16_pack_big(d->query,len + 27);
+  byte_copy(d->query + 2,12,flagrecursive ? "\0\0\1\0\0\1\0\0\0\0\0\1" : "\0\0\0\0\0\1\0\0\0\0\0\1gcc-bug-workaround");
   byte_copy(d->query + 14,len,q);
   byte_copy(d->query + 14 + len,2,qtype);
   byte_copy(d->query + 16 + len,2,DNS_C_IN);
 
+  /* EDNS0 OPT record: root; type; payload size; no extended flags; no data */
+  byte_copy(d->query + 18 + len,3,"\0" DNS_T_OPT);
+  uint16_pack_big(d->query + 21 + len,DNS_EDNS0_SIZE);
+  byte_zero(d->query + 23 + len,6);
+
   byte_copy(d->qtype,2,qtype);
-  d->servers = servers;
+  byte_copy(d->servers,64,servers);
+  dns_rtt_sort(d->servers);
   byte_copy(d->localip,4,localip);
 
   d->udploop = flagrecursive ? 1 : 0;
@@ -226,7 +671,7 @@ void dns_transmit_io(struct dns_transmit *d,iopause_fd *x,struct taia *deadline)
   x->fd = d->s1 - 1;
 
   switch(d->tcpstate) {
-    case 0: case 3: case 4: case 5:
+    case 0: case 3: case 4:
       x->events = IOPAUSE_READ;
       break;
     case 1: case 2:
@@ -236,12 +681,21 @@ void dns_transmit_io(struct dns_transmit *d,iopause_fd *x,struct taia *deadline)
 
   if (taia_less(&d->deadline,deadline))
     *deadline = d->deadline;
+  if (!d->tcpstate && d->hedge && !d->hedged)
+    if (taia_less(&d->hedgeat,deadline))
+      *deadline = d->hedgeat;
 }
 
 int dns_transmit_get(struct dns_transmit *d,const iopause_fd *x,const struct taia *when)
 {
-  char udpbuf[513];
-  unsigned char ch;
+  char udpbuf[DNS_EDNS0_SIZE + 1];
+  char ip[4];
+  uint16 port;
+  uint16 id;
+  struct tcpconn *c;
+  struct taia now;
+  struct taia elapsed;
+  unsigned int from;
   int r;
   int fd;
 
@@ -249,9 +703,14 @@ int dns_transmit_get(struct dns_transmit *d,const iopause_fd *x,const struct tai
   fd = d->s1 - 1;
 
   if (!x->revents) {
+    if (!d->tcpstate && d->hedge && !d->hedged)
+      if (!taia_less(when,&d->hedgeat)) hedgesend(d);
     if (taia_less(when,&d->deadline)) return 0;
     errno = error_timeout;
-    if (d->tcpstate == 0) return nextudp(d);
+    if (d->tcpstate == 0) {
+      dns_rtt_timeout(d->servers + 4 * d->curserver);
+      return nextudp(d);
+    }
     return nexttcp(d);
   }
 
@@ -260,14 +719,35 @@ int dns_transmit_get(struct dns_transmit *d,const iopause_fd *x,const struct tai
 have attempted to send UDP query to each server udploop times
 have sent query to curserver on UDP socket s
 */
-    r = recv(fd,udpbuf,sizeof udpbuf,0);
-    if (r <= 0) {
+    r = socket_recv4(fd,udpbuf,sizeof udpbuf,ip,&port);
+    if (r == -1) {
+      if (errno == error_again) return 0;
       if (errno == error_connrefused) if (d->udploop == 2) return 0;
       return nextudp(d);
     }
+    if (port != 53) return 0;
+    if (byte_equal(ip,4,d->servers + 4 * d->curserver))
+      from = d->curserver;
+    else if (d->hedged && byte_equal(ip,4,d->servers + 4 * (d->hedge - 1)))
+      from = d->hedge - 1;
+    else
+      return 0;
+    if (r == 0) {
+      if (from != d->curserver) return 0;
+      return nextudp(d);
+    }
     if (r + 1 > sizeof udpbuf) return 0;
 
     if (irrelevant(d,udpbuf,r)) return 0;
+    if (from != d->curserver) { /* the hedge answered first */
+      d->curserver = from;
+      d->sent = d->hedgeat;
+    }
+    d->hedge = 0;
+    d->hedged = 0;
+    taia_sub(&elapsed,when,&d->sent);
+    dns_rtt_sample(ip,taia_approx(&elapsed) * 1000000.0);
+    if (ednsrejected(d,udpbuf,r)) return thisudp(d);
     if (serverwantstcp(udpbuf,r)) return firsttcp(d);
     if (serverfailed(udpbuf,r)) {
       if (d->udploop == 2) return 0;
@@ -288,7 +768,11 @@ have sent query to curserver on UDP socket s
 have sent connection attempt to curserver on TCP socket s
 pos not defined
 */
-    if (!socket_connected(fd)) return nexttcp(d);
+    c = tcpconn + d->tcpconn - 1;
+    if (!c->connected) {
+      if (!socket_connected(fd)) { tcpbreak(c); return nexttcp(d); }
+      c->connected = 1;
+    }
     d->pos = 0;
     d->tcpstate = 2;
     return 0;
@@ -297,18 +781,35 @@ pos not defined
   if (d->tcpstate == 2) {
 /*
 have connection to curserver on TCP socket s
-have sent pos bytes of query
+have sent pos bytes of query, with id tcpid - 1 if pos
 */
-    r = write(fd,d->query + d->pos,d->querylen - d->pos);
-    if (r <= 0) return nexttcp(d);
+    c = tcpconn + d->tcpconn - 1;
+    if (c->broken) return failtcp(d);
+    if (!d->pos) {
+      if (c->writer) return 0;
+      do {
+        d->query[2] = dns_random(256);
+        d->query[3] = dns_random(256);
+        uint16_unpack_big(d->query + 2,&id);
+      } while (tcpfind(c,1 + id) < c->npending);
+    }
+    r = send(fd,d->query + d->pos,d->querylen - d->pos,MSG_NOSIGNAL);
+    if (r == -1) if ((errno == error_again) || (errno == error_wouldblock)) return 0;
+    if (r <= 0) return failtcp(d);
+    if (!d->pos) {
+      d->tcpid = 1 + id;
+      c->pending[c->npending++] = d->tcpid;
+    }
     d->pos += r;
-    if (d->pos == d->querylen) {
-      struct taia now;
-      taia_now(&now);
-      taia_uint(&d->deadline,10);
-      taia_add(&d->deadline,&d->deadline,&now);
-      d->tcpstate = 3;
+    if (d->pos < d->querylen) {
+      c->writer = d->tcpid;
+      return 0;
     }
+    c->writer = 0;
+    taia_now(&now);
+    taia_uint(&d->deadline,10);
+    taia_add(&d->deadline,&d->deadline,&now);
+    d->tcpstate = 3;
     return 0;
   }
 
@@ -317,44 +818,36 @@ have sent pos bytes of query
 have sent entire query to curserver on TCP socket s
 pos not defined
 */
-    r = read(fd,&ch,1);
-    if (r <= 0) return nexttcp(d);
-    d->packetlen = ch;
-    d->tcpstate = 4;
-    return 0;
-  }
-
-  if (d->tcpstate == 4) {
-/*
-have sent entire query to curserver on TCP socket s
-pos not defined
-have received one byte of packet length into packetlen
-*/
-    r = read(fd,&ch,1);
-    if (r <= 0) return nexttcp(d);
-    d->packetlen <<= 8;
-    d->packetlen += ch;
-    d->tcpstate = 5;
-    d->pos = 0;
+    r = tcphead(d);
+    if (r == -1) return failtcp(d);
+    if (r == 0) return 0;
     d->packet = alloc(d->packetlen);
     if (!d->packet) { dns_transmit_free(d); return -1; }
-    return 0;
+    uint16_pack_big(d->packet,d->tcpid - 1);
+    d->pos = 2;
+    d->tcpstate = 4;
   }
 
-  if (d->tcpstate == 5) {
+  if (d->tcpstate == 4) {
 /*
 have sent entire query to curserver on TCP socket s
 have received entire packet length into packetlen
 packet is allocated
-have received pos bytes of packet
+have received pos bytes of packet, the first two from the connection
 */
+    c = tcpconn + d->tcpconn - 1;
     r = read(fd,d->packet + d->pos,d->packetlen - d->pos);
-    if (r <= 0) return nexttcp(d);
+    if (r == -1) if ((errno == error_again) || (errno == error_wouldblock)) return 0;
+    if (r <= 0) { tcpbreak(c); return nexttcp(d); }
     d->pos += r;
     if (d->pos < d->packetlen) return 0;
 
-    socketfree(d);
+    c->reader = 0;
+    tcpanswered(c,tcpfind(c,d->tcpid));
+    d->tcpid = 0;
+    socketfree(d); /* back to the connection, for the next query */
     if (irrelevant(d,d->packet,d->packetlen)) return nexttcp(d);
+    if (ednsrejected(d,d->packet,d->packetlen)) return thistcp(d); /* on the same connection */
     if (serverwantstcp(d->packet,d->packetlen)) return nexttcp(d);
     if (serverfailed(d->packet,d->packetlen)) return nexttcp(d);
 
@@ -1,5 +1,7 @@
 #include <pthread.h>
 #include <signal.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include "env.h"
 #include "exit.h"
@@ -11,24 +13,35 @@
 #include "uint64.h"
 #include "socket.h"
 #include "dns.h"
+#include "stralloc.h"
 #include "taia.h"
 #include "byte.h"
 #include "roots.h"
 #include "fmt.h"
 #include "iopause.h"
+#include "ioevent.h"
+#include "timerheap.h"
 #include "query.h"
 #include "alloc.h"
 #include "response.h"
 #include "cachewrapper.h"
+#include "packetcache.h"
+#include "nscache.h"
 #include "ndelay.h"
 #include "log.h"
 #include "okclient.h"
 #include "droproot.h"
 #include "serverstate.h"
 #include "accesscontrol.h"
+#include "purge.h"
 #include "distributedcache.h"
 
-static int packetquery(char *buf,unsigned int len,char **q,char qtype[2],char qclass[2],char id[2])
+static unsigned int ednsmax = 1232; /* largest UDP response; 0: no EDNS0 */
+
+/*
+edns is set to the UDP payload size of the client's OPT record, 0 without one
+*/
+static int packetquery(char *buf,unsigned int len,char **q,char qtype[2],char qclass[2],char id[2],unsigned int *edns)
 {
   unsigned int pos;
   char header[12];
@@ -46,6 +59,7 @@ static int packetquery(char *buf,unsigned int len,char **q,char qtype[2],char qc
   pos = dns_packet_copy(buf,len,pos,qclass,2); if (!pos) return 0;
   if (byte_diff(qclass,2,DNS_C_IN) && byte_diff(qclass,2,DNS_C_ANY)) return 0;
 
+  *edns = ednsmax ? dns_packet_edns0(buf,len,pos) : 0;
   byte_copy(id,2,header);
   return 1;
 }
@@ -53,126 +67,526 @@ static int packetquery(char *buf,unsigned int len,char **q,char qtype[2],char qc
 
 static char myipoutgoing[4];
 static char myipincoming[4];
-static char buf[1024];
-uint64 numqueries = 0;
+uint64 numqueries = 0; /* shared by the workers, see nextquery */
 
+/*
+With WORKERS set above 1, that many threads each run the event loop below
+on their own udp53 and tcp53, bound with SO_REUSEPORT so the kernel
+spreads clients over them. Everything a worker owns is thread-local:
+its sockets, client tables, timers and epoll descriptor here, and the
+scratch state of query.c, response.c, log.c and dns_random.c. Only the
+caches, the access list and the server list are shared.
+*/
+static unsigned int workers = 1;
 
-static int udp53;
+static int bind53(int s)
+{
+  if (workers > 1) return socket_bind4_reuseport(s,myipincoming,53);
+  return socket_bind4_reuse(s,myipincoming,53);
+}
+
+static uint64 nextquery(void)
+{
+  return __sync_add_and_fetch(&numqueries,1);
+}
+
+static __thread char inbuf[SOCKET_MANY][1024];
+
+
+static __thread int udp53;
+
+static unsigned int maxudp = 200;
+static unsigned int maxtcp = 20;
+static unsigned int udppool = 64; /* pre-bound outgoing sockets per worker */
+static unsigned int hedge = 0; /* percent of upstream queries that may be hedged */
+
+/*
+ids of registered descriptors and timers:
+0: udp53
+1: tcp53
+2 ... 2 + maxudp - 1: u[]
+2 + maxudp ... 2 + maxudp + maxtcp - 1: t[]
+*/
+#define ID_UDP53 0
+#define ID_TCP53 1
+#define ID_U(j) (2 + (j))
+#define ID_T(j) (2 + maxudp + (j))
+
+static __thread struct timerheap timers;
+
+/*
+Every slot of a client table is either free or active. Free slots are
+kept on a stack and active slots on a list in order of arrival, so taking
+a slot, releasing one and finding the oldest to evict are all O(1).
+*/
+#define NOSLOT ((unsigned int) -1)
+
+struct slots {
+  unsigned int *next; /* indexed by slot */
+  unsigned int *prev; /* indexed by slot; only meaningful while active */
+  unsigned int oldest; /* first active slot, or NOSLOT */
+  unsigned int newest; /* last active slot, or NOSLOT */
+  unsigned int free; /* top of the free stack, or NOSLOT */
+} ;
+
+static int slots_init(struct slots *s,unsigned int n)
+{
+  unsigned int j;
+
+  s->next = (unsigned int *) alloc(n * sizeof(unsigned int));
+  if (!s->next) return 0;
+  s->prev = (unsigned int *) alloc(n * sizeof(unsigned int));
+  if (!s->prev) return 0;
+
+  for (j = 0;j < n;++j)
+    s->next[j] = (j + 1 < n) ? j + 1 : NOSLOT;
+  s->free = 0;
+  s->oldest = NOSLOT;
+  s->newest = NOSLOT;
+  return 1;
+}
+
+/* move a free slot to the end of the active list; NOSLOT if none is free */
+static unsigned int slots_take(struct slots *s)
+{
+  unsigned int j;
+
+  j = s->free;
+  if (j == NOSLOT) return NOSLOT;
+  s->free = s->next[j];
+
+  s->next[j] = NOSLOT;
+  s->prev[j] = s->newest;
+  if (s->newest == NOSLOT) s->oldest = j;
+  else s->next[s->newest] = j;
+  s->newest = j;
+  return j;
+}
+
+static void slots_release(struct slots *s,unsigned int j)
+{
+  if (s->prev[j] == NOSLOT) s->oldest = s->next[j];
+  else s->next[s->prev[j]] = s->next[j];
+  if (s->next[j] == NOSLOT) s->newest = s->prev[j];
+  else s->prev[s->next[j]] = s->prev[j];
+
+  s->next[j] = s->free;
+  s->free = j;
+}
 
-#define MAXUDP 200
-static struct udpclient {
-  struct query q;
-  struct taia start;
+/*
+u[] holds every query in progress: those read from udp53 and those read
+from a TCP connection in t[], which may have several in flight at once.
+*/
+static __thread struct udpclient {
+  struct query *q; /* 0 unless the query needs recursion */
   uint64 active; /* query number, if active; otherwise 0 */
-  iopause_fd *io;
+  iopause_fd io[QUERY_MAXIO];
+  unsigned int numio;
   char ip[4];
   uint16 port;
   char id[2];
-} u[MAXUDP];
-int uactive = 0;
+  unsigned int edns; /* payload size from the client's OPT record, or 0 */
+  unsigned int conn; /* index in t[], NOSLOT for UDP */
+  uint64 connserial; /* serial of t[conn] when the query was read */
+  char *qname; /* 0, or the question as the client spelled it */
+  char qtype[2];
+  char qclass[2];
+  int listed; /* on the in-flight table */
+  unsigned int hashnext; /* next query on the same in-flight chain */
+  unsigned int leader; /* query this one waits for, or NOSLOT */
+  unsigned int waiters; /* first query waiting for this one, or NOSLOT */
+  unsigned int nextwaiter;
+  unsigned int prevwaiter;
+} *u;
+static __thread struct slots uslots;
+int uactive = 0; /* all workers, for log_stats */
+
+static void t_reply(unsigned int,uint64);
+static void t_done(unsigned int,uint64);
+static void t_abort(unsigned int,uint64);
+
+/*
+In-flight table: every query being resolved by query.c, keyed on qtype,
+qclass and the qname without regard to case. A later query asking the
+same question does not start a recursion of its own; it waits for the
+listed one (its leader) and gets a copy of its response with its own ID
+and qname spelling.
+*/
+static __thread unsigned int *inflight;
+static __thread unsigned int inflightmask;
+
+static int inflight_init(unsigned int n)
+{
+  unsigned int size;
+  unsigned int i;
+
+  size = 1;
+  while (size < n) size <<= 1;
+  inflight = (unsigned int *) alloc(size * sizeof(unsigned int));
+  if (!inflight) return 0;
+  for (i = 0;i < size;++i) inflight[i] = NOSLOT;
+  inflightmask = size - 1;
+  return 1;
+}
+
+static unsigned int inflight_hash(const char *q,const char qtype[2])
+{
+  unsigned int h = 5381;
+  unsigned int len;
+  unsigned char ch;
+
+  h = ((h << 5) + h) ^ (unsigned char) qtype[0];
+  h = ((h << 5) + h) ^ (unsigned char) qtype[1];
+  len = dns_domain_length(q);
+  while (len--) {
+    ch = *q++;
+    if ((ch >= 'A') && (ch <= 'Z')) ch += 32;
+    h = ((h << 5) + h) ^ ch;
+  }
+  return h & inflightmask;
+}
+
+static unsigned int inflight_find(const char *q,const char qtype[2],const char qclass[2])
+{
+  unsigned int j;
+
+  for (j = inflight[inflight_hash(q,qtype)];j != NOSLOT;j = u[j].hashnext)
+    if (byte_equal(u[j].qtype,2,qtype) && byte_equal(u[j].qclass,2,qclass))
+      if (dns_domain_equal(u[j].qname,q))
+        return j;
+  return NOSLOT;
+}
+
+static void inflight_add(unsigned int j)
+{
+  unsigned int h = inflight_hash(u[j].qname,u[j].qtype);
+
+  u[j].hashnext = inflight[h];
+  inflight[h] = j;
+  u[j].listed = 1;
+}
+
+static void inflight_remove(unsigned int j)
+{
+  unsigned int *p;
+
+  if (!u[j].listed) return;
+  u[j].listed = 0;
+  for (p = inflight + inflight_hash(u[j].qname,u[j].qtype);*p != NOSLOT;p = &u[*p].hashnext)
+    if (*p == j) { *p = u[j].hashnext; return; }
+}
+
+/* make j wait for leader */
+static void u_wait(unsigned int j,unsigned int leader)
+{
+  u[j].leader = leader;
+  u[j].prevwaiter = NOSLOT;
+  u[j].nextwaiter = u[leader].waiters;
+  if (u[j].nextwaiter != NOSLOT) u[u[j].nextwaiter].prevwaiter = j;
+  u[leader].waiters = j;
+}
+
+static void u_unwait(unsigned int j)
+{
+  if (u[j].leader == NOSLOT) return;
+  if (u[j].prevwaiter == NOSLOT) u[u[j].leader].waiters = u[j].nextwaiter;
+  else u[u[j].prevwaiter].nextwaiter = u[j].nextwaiter;
+  if (u[j].nextwaiter != NOSLOT) u[u[j].nextwaiter].prevwaiter = u[j].prevwaiter;
+  u[j].leader = NOSLOT;
+}
+
+/* take the waiters off j; return the first, the rest follow through nextwaiter */
+static unsigned int u_detach(unsigned int j)
+{
+  unsigned int first;
+  unsigned int w;
+
+  first = u[j].waiters;
+  u[j].waiters = NOSLOT;
+  for (w = first;w != NOSLOT;w = u[w].nextwaiter)
+    u[w].leader = NOSLOT;
+  return first;
+}
+
+static void u_release(int j)
+{
+  u[j].active = 0; __sync_sub_and_fetch(&uactive,1);
+  timerheap_del(&timers,ID_U(j));
+  query_free(u[j].q);
+  u[j].q = 0;
+  inflight_remove(j);
+  u_unwait(j);
+  dns_domain_free(&u[j].qname);
+  slots_release(&uslots,j);
+  if (u[j].conn != NOSLOT) t_done(u[j].conn,u[j].connserial);
+}
 
 void u_drop(int j)
 {
+  unsigned int w;
+  unsigned int next;
+
   if (!u[j].active) return;
   log_querydrop(&u[j].active);
-  u[j].active = 0; --uactive;
+  w = u_detach(j);
+  u_release(j);
+  if (u[j].conn != NOSLOT) t_abort(u[j].conn,u[j].connserial);
+
+  for (;w != NOSLOT;w = next) {
+    next = u[w].nextwaiter;
+    u_drop(w);
+  }
 }
 
-void u_respond(int j)
+/*
+Replies are queued and sent together by u_flush, once the queue is full
+and at the end of every pass through the event loop
+*/
+static __thread char replybuf[SOCKET_MANY][4096];
+static __thread struct socket_datagram reply[SOCKET_MANY];
+static __thread unsigned int numreplies = 0;
+
+static void u_flush(void)
 {
-  if (!u[j].active) return;
+  if (!numreplies) return;
+  socket_sendmany4(udp53,reply,numreplies);
+  numreplies = 0;
+}
+
+static void u_send(int j)
+{
+  struct socket_datagram *r;
+  unsigned int max;
+
   response_id(u[j].id);
-  if (response_len > 512) response_tc();
-  socket_send4(udp53,response,response_len,u[j].ip,u[j].port);
+
+  if (u[j].conn != NOSLOT) {
+    if (u[j].edns) response_opt(ednsmax);
+    t_reply(u[j].conn,u[j].connserial);
+  }
+  else {
+    max = 512;
+    if (u[j].edns) max = ((u[j].edns < ednsmax) ? u[j].edns : ednsmax) - 11;
+    if (response_len > max) response_tc();
+    if (u[j].edns) response_opt(ednsmax);
+    if (numreplies == SOCKET_MANY) u_flush();
+    r = reply + numreplies++;
+    r->buf = replybuf[r - reply];
+    byte_copy(r->buf,response_len,response);
+    r->len = response_len;
+    byte_copy(r->ip,4,u[j].ip);
+    r->port = u[j].port;
+  }
+
   log_querydone(&u[j].active,response_len);
-  u[j].active = 0; --uactive;
+  u_release(j);
 }
 
-void u_new(void)
+void u_respond(int j)
 {
-  int j;
-  int i;
-  struct udpclient *x;
-  int len;
-  static char *q = 0;
-  char qtype[2];
-  char qclass[2];
+  static __thread stralloc fanout = {0};
+  unsigned int w;
+  unsigned int next;
+
+  if (!u[j].active) return;
 
-  for (j = 0;j < MAXUDP;++j)
-    if (!u[j].active)
-      break;
+  w = u_detach(j);
+  if (w == NOSLOT) { u_send(j); return; }
 
-  if (j >= MAXUDP) {
-    j = 0;
-    for (i = 1;i < MAXUDP;++i)
-      if (taia_less(&u[i].start,&u[j].start))
-	j = i;
-    errno = error_timeout;
-    u_drop(j);
+  if (!stralloc_copyb(&fanout,response,response_len)) {
+    u_send(j);
+    for (;w != NOSLOT;w = next) {
+      next = u[w].nextwaiter;
+      u_drop(w);
+    }
+    return;
   }
 
-  x = u + j;
-  taia_now(&x->start);
+  u_send(j);
+  for (;w != NOSLOT;w = next) {
+    next = u[w].nextwaiter;
+    byte_copy(response,fanout.len,fanout.s);
+    response_len = fanout.len;
+    byte_copy(response + 12,dns_domain_length(u[w].qname),u[w].qname);
+    u_send(w);
+  }
+}
 
-  len = socket_recv4(udp53,buf,sizeof buf,x->ip,&x->port);
-  if (len == -1) return;
-  if (len >= sizeof buf) return;
-  if (x->port < 1024) if (x->port != 53) return;
-  if (!okclient(x->ip)) return;
+/* register the descriptor and deadline of an active query */
+static void u_rearm(int j)
+{
+  struct taia deadline;
+  struct taia now;
+  unsigned int i;
 
-  if (!packetquery(buf,len,&q,qtype,qclass,x->id)) return;
+  taia_now(&now);
+  taia_uint(&deadline,120);
+  taia_add(&deadline,&deadline,&now);
+  u[j].numio = query_io(u[j].q,u[j].io,&deadline);
+  for (i = 0;i < u[j].numio;++i)
+    ioevent_set(u[j].io[i].fd,u[j].io[i].events,ID_U(j));
+  timerheap_set(&timers,ID_U(j),&deadline);
+}
+
+/* a free slot in u[], made by dropping the oldest query if necessary */
+static unsigned int u_take(void)
+{
+  unsigned int j;
+
+  j = slots_take(&uslots);
+  if (j == NOSLOT) {
+    errno = error_timeout;
+    u_drop(uslots.oldest);
+    j = slots_take(&uslots);
+  }
+  return j;
+}
 
-  x->active = ++numqueries; ++uactive;
+/* answer the query in u[j] from the packet cache or start resolving it */
+static void u_start(int j,char *q,char qtype[2],char qclass[2])
+{
+  struct udpclient *x = u + j;
+  unsigned int leader;
+
+  x->active = nextquery(); __sync_add_and_fetch(&uactive,1);
+  x->listed = 0;
+  x->leader = NOSLOT;
+  x->waiters = NOSLOT;
   log_query(&x->active,x->ip,x->port,x->id,q,qtype);
-  switch(query_start(&x->q,q,qtype,qclass,myipoutgoing)) {
+  if (packetcache_get(q,qtype,qclass)) {
+    log_cachedpacket(q,qtype);
+    u_respond(j);
+    return;
+  }
+
+  if (!dns_domain_copy(&x->qname,q)) { u_drop(j); return; }
+  byte_copy(x->qtype,2,qtype);
+  byte_copy(x->qclass,2,qclass);
+
+  leader = inflight_find(q,qtype,qclass);
+  if (leader != NOSLOT) {
+    log_querywait(&x->active,&u[leader].active);
+    u_wait(j,leader);
+    return;
+  }
+
+  x->q = query_new();
+  if (!x->q) { u_drop(j); return; }
+  switch(query_start(x->q,q,qtype,qclass,myipoutgoing)) {
     case -1:
       u_drop(j);
       return;
     case 1:
       u_respond(j);
+      return;
   }
+  inflight_add(j);
+  u_rearm(j);
 }
 
+static void u_query(char *buf,unsigned int len,char ip[4],uint16 port)
+{
+  unsigned int j;
+  struct udpclient *x;
+  static __thread char *q = 0;
+  char qtype[2];
+  char qclass[2];
+  char id[2];
+  unsigned int edns;
 
-static int tcp53;
+  if (len >= sizeof inbuf[0]) return;
+  if (port < 1024) if (port != 53) return;
+  if (!okclient(ip)) return;
 
-#define MAXTCP 20
-struct tcpclient {
-  struct query q;
-  struct taia start;
-  struct taia timeout;
-  uint64 active; /* query number or 1, if active; otherwise 0 */
-  iopause_fd *io;
-  char ip[4]; /* send response to this address */
-  uint16 port; /* send response to this port */
-  char id[2];
-  int tcp; /* open TCP socket, if active */
-  int state;
-  char *buf; /* 0, or dynamically allocated of length len */
-  unsigned int len;
-  unsigned int pos;
-} t[MAXTCP];
-int tactive = 0;
+  if (!packetquery(buf,len,&q,qtype,qclass,id,&edns)) return;
+
+  j = u_take();
+  x = u + j;
+  byte_copy(x->ip,4,ip);
+  x->port = port;
+  byte_copy(x->id,2,id);
+  x->edns = edns;
+  x->conn = NOSLOT;
+  u_start(j,q,qtype,qclass);
+}
+
+/* handle every datagram waiting on udp53, up to SOCKET_MANY of them */
+void u_new(void)
+{
+  static __thread struct socket_datagram in[SOCKET_MANY];
+  int n;
+  int i;
+
+  for (i = 0;i < SOCKET_MANY;++i) {
+    in[i].buf = inbuf[i];
+    in[i].size = sizeof inbuf[i];
+  }
+
+  n = socket_recvmany4(udp53,in,SOCKET_MANY);
+  for (i = 0;i < n;++i)
+    u_query(in[i].buf,in[i].len,in[i].ip,in[i].port);
+}
 
 /*
-state 1: buf 0; normal state at beginning of TCP connection
-state 2: buf 0; have read 1 byte of query packet length into len
-state 3: buf allocated; have read pos bytes of buf
-state 0: buf 0; handling query in q
-state -1: buf allocated; have written pos bytes
+fd is 0 and revents 0 when the deadline of the query passed
 */
-
-void t_free(int j)
+static void u_io(int j,int fd,short revents,struct taia *stamp)
 {
-  if (!t[j].buf) return;
-  alloc_free(t[j].buf);
-  t[j].buf = 0;
+  unsigned int i;
+  unsigned int k = 0;
+  int r;
+
+  if (u[j].active)
+    for (k = 0;k < u[j].numio;++k)
+      if (u[j].io[k].fd == fd) break;
+  if (!u[j].active || (revents && (k == u[j].numio))) {
+    if (revents) ioevent_del(fd); /* stale registration */
+    return;
+  }
+
+  for (i = 0;i < u[j].numio;++i)
+    u[j].io[i].revents = 0;
+  if (revents) u[j].io[k].revents = revents;
+  r = query_get(u[j].q,u[j].io,stamp);
+  if (r == -1) u_drop(j);
+  else if (r == 1) u_respond(j);
+  else u_rearm(j);
 }
 
+
+static __thread int tcp53;
+static __thread unsigned int workerid; /* index in w[] */
+
+/*
+A connection reads as much as the socket has and starts every complete
+length-prefixed query in its input, up to MAXTCPQUERIES in flight at once.
+Replies go out in the order the queries finish. A reply is written with
+one writev straight from response[] when nothing is queued before it;
+whatever the socket does not take waits in out.
+*/
+#define MAXTCPQUERIES 16
+
+static __thread struct tcpclient {
+  uint64 serial; /* nonzero while active */
+  struct taia timeout;
+  int tcp; /* open TCP socket, if active */
+  char ip[4]; /* send response to this address */
+  uint16 port; /* send response to this port */
+  unsigned int inflight; /* queries in u[] */
+  int eof; /* client has sent everything it will */
+  stralloc in; /* unparsed input */
+  stralloc out; /* unwritten replies, starting at outpos */
+  unsigned int outpos;
+} *t;
+static __thread struct slots tslots;
+static __thread uint64 numconnections = 0;
+int tactive = 0; /* all workers, for log_stats */
+
 void t_timeout(int j)
 {
   struct taia now;
-  if (!t[j].active) return;
+  if (!t[j].serial) return;
   taia_now(&now);
   taia_uint(&t[j].timeout,10);
   taia_add(&t[j].timeout,&t[j].timeout,&now);
@@ -180,210 +594,291 @@ void t_timeout(int j)
 
 void t_close(int j)
 {
-  if (!t[j].active) return;
-  t_free(j);
+  if (!t[j].serial) return;
   log_tcpclose(t[j].ip,t[j].port);
   close(t[j].tcp);
-  t[j].active = 0; --tactive;
+  t[j].serial = 0; __sync_sub_and_fetch(&tactive,1);
+  timerheap_del(&timers,ID_T(j));
+  slots_release(&tslots,j);
+
+  /* keep ordinary buffers for the next connection in this slot */
+  t[j].in.len = 0;
+  if (t[j].in.a > 4096) { alloc_free(t[j].in.s); t[j].in.s = 0; t[j].in.a = 0; }
+  t[j].out.len = 0;
+  if (t[j].out.a > 4096) { alloc_free(t[j].out.s); t[j].out.s = 0; t[j].out.a = 0; }
 }
 
-void t_drop(int j)
+/* queue response[] on connection j, unless it went away */
+static void t_reply(unsigned int j,uint64 serial)
 {
-  log_querydrop(&t[j].active);
-  errno = error_pipe;
-  t_close(j);
+  struct tcpclient *x = t + j;
+  struct iovec v[2];
+  char len[2];
+  unsigned int done;
+  int r;
+
+  if (x->serial != serial) return;
+
+  uint16_pack_big(len,response_len);
+  done = 0;
+  if (x->outpos == x->out.len) {
+    x->out.len = 0;
+    x->outpos = 0;
+    v[0].iov_base = len;
+    v[0].iov_len = 2;
+    v[1].iov_base = response;
+    v[1].iov_len = response_len;
+    r = writev(x->tcp,v,2);
+    if (r == -1) {
+      if ((errno != error_again) && (errno != error_wouldblock)) { t_close(j); return; }
+      r = 0;
+    }
+    done = r;
+    if (done) t_timeout(j);
+  }
+
+  if (done < 2)
+    if (!stralloc_catb(&x->out,len + done,2 - done)) { t_close(j); return; }
+  if (done < 2) done = 2;
+  if (!stralloc_catb(&x->out,response + done - 2,response_len + 2 - done)) t_close(j);
 }
 
-void t_respond(int j)
+/*
+A query of connection j finished. If it was holding up the input, have
+t_io look at the connection again right away.
+*/
+static void t_done(unsigned int j,uint64 serial)
 {
-  if (!t[j].active) return;
-  log_querydone(&t[j].active,response_len);
-  response_id(t[j].id);
-  t[j].len = response_len + 2;
-  t_free(j);
-  t[j].buf = alloc(response_len + 2);
-  if (!t[j].buf) { t_close(j); return; }
-  uint16_pack_big(t[j].buf,response_len);
-  byte_copy(t[j].buf + 2,response_len,response);
-  t[j].pos = 0;
-  t[j].state = -1;
+  struct taia now;
+
+  if (t[j].serial != serial) return;
+  --t[j].inflight;
+  byte_zero(&now,sizeof now);
+  timerheap_set(&timers,ID_T(j),&now);
 }
 
-void t_rw(int j)
+/* a query of connection j failed; as before, the client sees the connection close */
+static void t_abort(unsigned int j,uint64 serial)
 {
-  struct tcpclient *x;
-  char ch;
-  static char *q = 0;
+  if (t[j].serial != serial) return;
+  errno = error_pipe;
+  t_close(j);
+}
+
+static void t_query(int j,char *buf,unsigned int len)
+{
+  unsigned int k;
+  struct udpclient *x;
+  uint64 serial = t[j].serial;
+  static __thread char *q = 0;
   char qtype[2];
   char qclass[2];
-  int r;
+  char id[2];
+  unsigned int edns;
+
+  if (!packetquery(buf,len,&q,qtype,qclass,id,&edns)) { t_close(j); return; }
+
+  k = u_take();
+  if (t[j].serial != serial) { slots_release(&uslots,k); return; } /* evicted */
+
+  x = u + k;
+  byte_copy(x->ip,4,t[j].ip);
+  x->port = t[j].port;
+  byte_copy(x->id,2,id);
+  x->edns = edns;
+  x->conn = j;
+  x->connserial = serial;
+  ++t[j].inflight;
+  u_start(k,q,qtype,qclass);
+}
 
-  x = t + j;
-  if (x->state == -1) {
-    r = write(x->tcp,x->buf + x->pos,x->len - x->pos);
-    if (r <= 0) { t_close(j); return; }
-    x->pos += r;
-    if (x->pos == x->len) {
-      t_free(j);
-      x->state = 1; /* could drop connection immediately */
-    }
-    return;
+/* start every complete query in the input, as far as MAXTCPQUERIES allows */
+static void t_parse(int j)
+{
+  struct tcpclient *x = t + j;
+  uint64 serial = x->serial;
+  unsigned int pos;
+  uint16 len;
+
+  pos = 0;
+  while (x->inflight < MAXTCPQUERIES) {
+    if (x->in.len - pos < 2) break;
+    uint16_unpack_big(x->in.s + pos,&len);
+    if (!len) { errno = error_proto; t_close(j); return; }
+    if (x->in.len - pos - 2 < len) break;
+    t_query(j,x->in.s + pos + 2,len);
+    if (x->serial != serial) return;
+    pos += 2 + len;
   }
 
-  r = read(x->tcp,&ch,1);
-  if (r == 0) { errno = error_pipe; t_close(j); return; }
-  if (r < 0) { t_close(j); return; }
+  if (pos) {
+    byte_copy(x->in.s,x->in.len - pos,x->in.s + pos);
+    x->in.len -= pos;
+  }
+}
+
+static void t_read(int j)
+{
+  struct tcpclient *x = t + j;
+  int r;
 
-  if (x->state == 1) {
-    x->len = (unsigned char) ch;
-    x->len <<= 8;
-    x->state = 2;
+  if (!stralloc_readyplus(&x->in,4096)) { t_close(j); return; }
+  r = read(x->tcp,x->in.s + x->in.len,x->in.a - x->in.len);
+  if (r == -1) {
+    if ((errno != error_again) && (errno != error_wouldblock)) t_close(j);
     return;
   }
-  if (x->state == 2) {
-    x->len += (unsigned char) ch;
-    if (!x->len) { errno = error_proto; t_close(j); return; }
-    x->buf = alloc(x->len);
-    if (!x->buf) { t_close(j); return; }
-    x->pos = 0;
-    x->state = 3;
+  if (r == 0) { x->eof = 1; return; }
+  x->in.len += r;
+  t_timeout(j);
+}
+
+static void t_write(int j)
+{
+  struct tcpclient *x = t + j;
+  int r;
+
+  if (x->outpos == x->out.len) return;
+  r = write(x->tcp,x->out.s + x->outpos,x->out.len - x->outpos);
+  if (r == -1) {
+    if ((errno != error_again) && (errno != error_wouldblock)) t_close(j);
     return;
   }
+  x->outpos += r;
+  if (x->outpos == x->out.len) { x->out.len = 0; x->outpos = 0; }
+  t_timeout(j);
+}
 
-  if (x->state != 3) return; /* impossible */
+/*
+register the descriptor and deadline of an active connection
+the connection only times out while it is idle or its replies are stuck
+*/
+static void t_rearm(int j)
+{
+  struct tcpclient *x = t + j;
+  short events = 0;
 
-  x->buf[x->pos++] = ch;
-  if (x->pos < x->len) return;
+  if (!x->eof && (x->inflight < MAXTCPQUERIES)) events |= IOPAUSE_READ;
+  if (x->outpos < x->out.len) events |= IOPAUSE_WRITE;
+  ioevent_set(x->tcp,events,ID_T(j));
 
-  if (!packetquery(x->buf,x->len,&q,qtype,qclass,x->id)) { t_close(j); return; }
+  if (!x->inflight || (x->outpos < x->out.len))
+    timerheap_set(&timers,ID_T(j),&x->timeout);
+  else
+    timerheap_del(&timers,ID_T(j));
+}
 
-  x->active = ++numqueries;
-  log_query(&x->active,x->ip,x->port,x->id,q,qtype);
-  switch(query_start(&x->q,q,qtype,qclass,myipoutgoing)) {
-    case -1:
-      t_drop(j);
-      return;
-    case 1:
-      t_respond(j);
-      return;
+/*
+fd is 0 and revents 0 when the timer of the connection fired: the idle
+timeout, or t_done asking for the input to be looked at again
+*/
+static void t_io(int j,int fd,short revents,struct taia *stamp)
+{
+  struct tcpclient *x = t + j;
+
+  if (!x->serial || (revents && (fd != x->tcp))) {
+    if (revents) ioevent_del(fd); /* stale registration */
+    return;
   }
-  t_free(j);
-  x->state = 0;
+
+  if (revents & IOPAUSE_WRITE) t_write(j);
+  if (x->serial && (revents & IOPAUSE_READ)) t_read(j);
+  if (x->serial) t_parse(j);
+  if (!x->serial) return;
+
+  if (x->eof && !x->inflight && (x->outpos == x->out.len)) { t_close(j); return; }
+  if (!revents && !taia_less(stamp,&x->timeout))
+    if (!x->inflight || (x->outpos < x->out.len)) { errno = error_timeout; t_close(j); return; }
+
+  t_rearm(j);
 }
 
 void t_new(void)
 {
-  int i;
-  int j;
+  unsigned int j;
   struct tcpclient *x;
+  int tcp;
+  char ip[4];
+  uint16 port;
 
-  for (j = 0;j < MAXTCP;++j)
-    if (!t[j].active)
-      break;
+  tcp = socket_accept4(tcp53,ip,&port);
+  if (tcp == -1) return;
+  if (port < 1024) if (port != 53) { close(tcp); return; }
+  if (!okclient(ip)) { close(tcp); return; }
+  if (ndelay_on(tcp) == -1) { close(tcp); return; } /* Linux bug */
 
-  if (j >= MAXTCP) {
-    j = 0;
-    for (i = 1;i < MAXTCP;++i)
-      if (taia_less(&t[i].start,&t[j].start))
-	j = i;
+  j = slots_take(&tslots);
+  if (j == NOSLOT) {
     errno = error_timeout;
-    if (t[j].state == 0)
-      t_drop(j);
-    else
-      t_close(j);
+    t_close(tslots.oldest);
+    j = slots_take(&tslots);
   }
 
   x = t + j;
-  taia_now(&x->start);
-
-  x->tcp = socket_accept4(tcp53,x->ip,&x->port);
-  if (x->tcp == -1) return;
-  if (x->port < 1024) if (x->port != 53) { close(x->tcp); return; }
-  if (!okclient(x->ip)) { close(x->tcp); return; }
-  if (ndelay_on(x->tcp) == -1) { close(x->tcp); return; } /* Linux bug */
-
-  x->active = 1; ++tactive;
-  x->state = 1;
+  x->tcp = tcp;
+  byte_copy(x->ip,4,ip);
+  x->port = port;
+  x->serial = ++numconnections; __sync_add_and_fetch(&tactive,1);
+  x->inflight = 0;
+  x->eof = 0;
+  x->in.len = 0;
+  x->out.len = 0;
+  x->outpos = 0;
   t_timeout(j);
+  t_rearm(j);
 
   log_tcpopen(x->ip,x->port);
 }
 
 
-iopause_fd io[3 + MAXUDP + MAXTCP];
-iopause_fd *udp53io;
-iopause_fd *tcp53io;
+static void dispatch(unsigned int id,int fd,short revents,struct taia *stamp)
+{
+  if (id == ID_UDP53) { u_new(); return; }
+  if (id == ID_TCP53) { t_new(); return; }
+  if (id < ID_T(0)) { u_io(id - ID_U(0),fd,revents,stamp); return; }
+  if (id < ID_T(maxtcp)) t_io(id - ID_T(0),fd,revents,stamp);
+}
 
+/*
+Descriptors stay registered between iterations; only the ones that are
+ready and the queries whose deadline passed are looked at.
+*/
 static void doit(void)
 {
-  int j;
+  struct ioevent ready[64];
   struct taia deadline;
   struct taia stamp;
-  int iolen;
-  int r;
+  struct taia when;
+  unsigned int id;
+  int numready;
+  int i;
+
+  if (ioevent_set(udp53,IOPAUSE_READ,ID_UDP53) == -1) return;
+  if (ioevent_set(tcp53,IOPAUSE_READ,ID_TCP53) == -1) return;
 
   for (; keepRunning; ) {
     taia_now(&stamp);
     taia_uint(&deadline,120);
     taia_add(&deadline,&deadline,&stamp);
+    if (timerheap_min(&timers,&id,&when))
+      if (taia_less(&when,&deadline)) deadline = when;
+
+    accesscontrol_offline(workerid); /* an old client table may go meanwhile */
+    numready = ioevent_wait(ready,sizeof ready / sizeof ready[0],&deadline,&stamp);
+    accesscontrol_online(workerid);
+    taia_now(&stamp);
+
+    for (i = 0;i < numready;++i)
+      dispatch(ready[i].id,ready[i].fd,ready[i].revents,&stamp);
 
-    iolen = 0;
-
-    udp53io = io + iolen++;
-    udp53io->fd = udp53;
-    udp53io->events = IOPAUSE_READ;
-
-    tcp53io = io + iolen++;
-    tcp53io->fd = tcp53;
-    tcp53io->events = IOPAUSE_READ;
-
-    for (j = 0;j < MAXUDP;++j)
-      if (u[j].active) {
-	u[j].io = io + iolen++;
-	query_io(&u[j].q,u[j].io,&deadline);
-      }
-    for (j = 0;j < MAXTCP;++j)
-      if (t[j].active) {
-	t[j].io = io + iolen++;
-	if (t[j].state == 0)
-	  query_io(&t[j].q,t[j].io,&deadline);
-	else {
-	  if (taia_less(&t[j].timeout,&deadline)) deadline = t[j].timeout;
-	  t[j].io->fd = t[j].tcp;
-	  t[j].io->events = (t[j].state > 0) ? IOPAUSE_READ : IOPAUSE_WRITE;
-	}
-      }
-
-    iopause(io,iolen,&deadline,&stamp);
-
-    for (j = 0;j < MAXUDP;++j)
-      if (u[j].active) {
-	r = query_get(&u[j].q,u[j].io,&stamp);
-	if (r == -1) u_drop(j);
-	if (r == 1) u_respond(j);
-      }
-
-    for (j = 0;j < MAXTCP;++j)
-      if (t[j].active) {
-	if (t[j].io->revents)
-	  t_timeout(j);
-	if (t[j].state == 0) {
-	  r = query_get(&t[j].q,t[j].io,&stamp);
-	  if (r == -1) t_drop(j);
-	  if (r == 1) t_respond(j);
-	}
-	else
-	  if (t[j].io->revents || taia_less(&t[j].timeout,&stamp))
-	    t_rw(j);
-      }
-
-    if (udp53io)
-      if (udp53io->revents)
-	u_new();
-
-    if (tcp53io)
-      if (tcp53io->revents)
-	t_new();
+    while (timerheap_min(&timers,&id,&deadline)) {
+      if (taia_less(&stamp,&deadline)) break;
+      timerheap_del(&timers,id);
+      dispatch(id,0,0,&stamp);
+    }
+
+    u_flush();
+    dns_transmit_refill();
   }
 }
   
@@ -391,6 +886,63 @@ static void doit(void)
 
 char seed[128];
 
+/*
+Every active UDP query holds an outgoing socket, every TCP client its
+connection and possibly an outgoing socket. Raise the soft descriptor
+limit towards that, as far as the hard limit allows.
+*/
+static void nofile(unsigned long want)
+{
+  struct rlimit r;
+
+  if (getrlimit(RLIMIT_NOFILE,&r) == -1) return;
+  if (r.rlim_cur == RLIM_INFINITY || r.rlim_cur >= want) return;
+  r.rlim_cur = want;
+  if (r.rlim_max != RLIM_INFINITY && r.rlim_cur > r.rlim_max) r.rlim_cur = r.rlim_max;
+  setrlimit(RLIMIT_NOFILE,&r);
+}
+
+struct worker {
+  int udp53;
+  int tcp53;
+  char seed[128];
+  pthread_t tid;
+} ;
+static struct worker *w;
+
+static void *worker(void *arg)
+{
+  struct worker *me = arg;
+
+  udp53 = me->udp53;
+  tcp53 = me->tcp53;
+  workerid = me - w;
+  dns_random_init(me->seed);
+
+  u = (struct udpclient *) alloc(maxudp * sizeof(struct udpclient));
+  if (!u)
+    strerr_die2x(111,FATAL,"not enough memory for UDP clients");
+  byte_zero(u,maxudp * sizeof(struct udpclient));
+  t = (struct tcpclient *) alloc(maxtcp * sizeof(struct tcpclient));
+  if (!t)
+    strerr_die2x(111,FATAL,"not enough memory for TCP clients");
+  byte_zero(t,maxtcp * sizeof(struct tcpclient));
+  if (!slots_init(&uslots,maxudp) || !slots_init(&tslots,maxtcp))
+    strerr_die2x(111,FATAL,"not enough memory for client tables");
+  if (!inflight_init(maxudp))
+    strerr_die2x(111,FATAL,"not enough memory for in-flight table");
+
+  if (ioevent_init() == -1)
+    strerr_die2sys(111,FATAL,"unable to create epoll descriptor: ");
+  if (!timerheap_init(&timers,ID_T(maxtcp)))
+    strerr_die2x(111,FATAL,"not enough memory for timers");
+  if (dns_transmit_pool(myipoutgoing,udppool) == -1)
+    strerr_die2x(111,FATAL,"not enough memory for outgoing socket pool");
+
+  doit();
+  return 0;
+}
+
 void sighandler(int sig) {
   if(sig == SIGINT) {
     keepRunning = 0;
@@ -401,10 +953,16 @@ int main()
 {
   char *x;
   unsigned long cachesize = 0L;
-  pthread_t tidaccesscontrol, tiddistributedcache;
+  unsigned long packetcachesize = 0L;
+  unsigned long nscachesize = 4194304L;
+  unsigned int i;
+  pthread_t tidaccesscontrol, tiddistributedcache, tidpurge;
+  int purge = 0;
   struct sigaction act;
   act.sa_handler = sighandler;
   sigaction(SIGINT, &act, 0);
+  act.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &act, 0); /* a TCP client going away must not kill us */
 
   x = env_get("IP");
   if (!x)
@@ -412,25 +970,40 @@ int main()
   if (!ip4_scan(x,myipincoming))
     strerr_die3x(111,FATAL,"unable to parse IP address ",x);
 
-  udp53 = socket_udp();
-  if (udp53 == -1)
-    strerr_die2sys(111,FATAL,"unable to create UDP socket: ");
-  if (socket_bind4_reuse(udp53,myipincoming,53) == -1)
-    strerr_die2sys(111,FATAL,"unable to bind UDP socket: ");
-
-  tcp53 = socket_tcp();
-  if (tcp53 == -1)
-    strerr_die2sys(111,FATAL,"unable to create TCP socket: ");
-  if (socket_bind4_reuse(tcp53,myipincoming,53) == -1)
-    strerr_die2sys(111,FATAL,"unable to bind TCP socket: ");
+  x = env_get("WORKERS");
+  if (x)
+    scan_uint(x,&workers);
+  if (workers < 1) workers = 1;
+  if (workers > 256) workers = 256;
+  w = (struct worker *) alloc(workers * sizeof(struct worker));
+  if (!w)
+    strerr_die2x(111,FATAL,"not enough memory for workers");
+
+  for (i = 0;i < workers;++i) {
+    w[i].udp53 = socket_udp();
+    if (w[i].udp53 == -1)
+      strerr_die2sys(111,FATAL,"unable to create UDP socket: ");
+    if (bind53(w[i].udp53) == -1)
+      strerr_die2sys(111,FATAL,"unable to bind UDP socket: ");
+
+    w[i].tcp53 = socket_tcp();
+    if (w[i].tcp53 == -1)
+      strerr_die2sys(111,FATAL,"unable to create TCP socket: ");
+    if (bind53(w[i].tcp53) == -1)
+      strerr_die2sys(111,FATAL,"unable to bind TCP socket: ");
+  }
 
   droproot(FATAL);
 
-  socket_tryreservein(udp53,131072);
+  for (i = 0;i < workers;++i)
+    socket_tryreservein(w[i].udp53,131072);
 
   byte_zero(seed,sizeof seed);
   read(0,seed,sizeof seed);
-  dns_random_init(seed);
+  for (i = 0;i < workers;++i) {
+    byte_copy(w[i].seed,sizeof seed,seed);
+    w[i].seed[0] ^= i; /* dns_random_init adds the time, but make sure */
+  }
   close(0);
 
   x = env_get("IPSEND");
@@ -462,13 +1035,26 @@ int main()
   if (!cache_init_wrapper(distributedcache, cachesize, cacheserverspath))
     strerr_die2x(111,FATAL,"cache wrapper initialization failed");
 
+  x = env_get("NSCACHESIZE");
+  if (x)
+    scan_ulong(x,&nscachesize);
+  if (!nscache_init(nscachesize))
+    strerr_die2x(111,FATAL,"not enough memory for delegation cache");
+
+  x = env_get("PACKETCACHESIZE");
+  if (x)
+    scan_ulong(x,&packetcachesize);
+  if (!packetcache_init(packetcachesize))
+    strerr_die2x(111,FATAL,"not enough memory for packet cache");
+
   if (env_get("HIDETTL"))
     response_hidettl();
   if (env_get("FORWARDONLY"))
     query_forwardonly();
 
-  if (socket_listen(tcp53,20) == -1)
-    strerr_die2sys(111,FATAL,"unable to listen on TCP socket: ");
+  for (i = 0;i < workers;++i)
+    if (socket_listen(w[i].tcp53,20) == -1)
+      strerr_die2sys(111,FATAL,"unable to listen on TCP socket: ");
 
   char *customdomain = 0;
   char customdnsserverip[4];
@@ -492,7 +1078,7 @@ int main()
   x = env_get("ACCESSCONTROL");
   if (!x)
     strerr_die2x(111,FATAL,"$ACCESSCONTROL not set");
-  if(initializeaccesscontrol(x) != 1) {
+  if(initializeaccesscontrol(x, workers) != 1) {
     strerr_die2sys(111,FATAL,"Unable to initialize accesscontrol");
   }
   pthread_create(&tidaccesscontrol, 0, updateAccessControl, 0);
@@ -500,12 +1086,58 @@ int main()
     pthread_create(&tiddistributedcache, 0, monitorserverlistforupdates, 0);
   }
 
+  x = env_get("PURGE");
+  if (x) {
+    if (initializepurge(x) != 1)
+      strerr_die2x(111,FATAL,"out of memory");
+    purge = !pthread_create(&tidpurge, 0, updatePurge, 0);
+  }
+
+  x = env_get("MAXUDP");
+  if (x)
+    scan_uint(x,&maxudp);
+  if (maxudp < 1) maxudp = 1;
+  if (maxudp > 1000000) maxudp = 1000000;
+  x = env_get("MAXTCP");
+  if (x)
+    scan_uint(x,&maxtcp);
+  if (maxtcp < 1) maxtcp = 1;
+  if (maxtcp > 1000000) maxtcp = 1000000;
+
+  x = env_get("EDNSSIZE");
+  if (x)
+    scan_uint(x,&ednsmax);
+  if (ednsmax) {
+    if (ednsmax < 512) ednsmax = 512;
+    if (ednsmax > 4096) ednsmax = 4096;
+  }
+
+  x = env_get("HEDGE");
+  if (x)
+    scan_uint(x,&hedge);
+  dns_transmit_hedge(hedge);
+
+  x = env_get("UDPPOOL");
+  if (x)
+    scan_uint(x,&udppool);
+  if (udppool > 4096) udppool = 4096;
+
+  nofile(workers * (maxudp + 2 * maxtcp + udppool + 8) + 64);
+
   log_startup();
-  doit();
+  for (i = 1;i < workers;++i)
+    if (pthread_create(&w[i].tid,0,worker,w + i))
+      strerr_die2x(111,FATAL,"unable to start worker thread");
+  worker(w);
+  for (i = 1;i < workers;++i)
+    pthread_join(w[i].tid,0);
 
   pthread_join(tidaccesscontrol, 0);
 
   if(distributedcache) {
     pthread_join(tiddistributedcache, 0);
   }
+  if(purge) {
+    pthread_join(tidpurge, 0);
+  }
 }
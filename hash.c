@@ -1,5 +1,7 @@
 #include <openssl/sha.h>
 
+#include "hash.h"
+#include "uint32.h"
 #include "uint64.h"
 
 /*
@@ -21,3 +23,81 @@ uint64 hashcode(const char* key, const int len) {
 
   return hashval;
 }
+
+/*
+ * Names are hashed from the root leftwards, one label on top of the hash
+ * of its parent, so hashing a name once yields the hash of every ancestor.
+ * The type goes in last. Case is ignored.
+ */
+static uint32 hashlabel(uint32 h, const char *label) {
+  unsigned int len = 1 + (unsigned char) *label;
+  unsigned char ch;
+
+  while(len--) {
+    ch = *label++;
+    if(ch >= 'A' && ch <= 'Z') ch += 32;
+    h = (h << 5) + h;
+    h ^= ch;
+  }
+  return h;
+}
+
+/*
+ * d must be a valid name, at most 127 labels
+ */
+void hashname(struct namehash *nh, const char *d) {
+  unsigned int pos[127];
+  unsigned int n = 0;
+  unsigned int i = 0;
+  uint32 h = 5381;
+
+  while(d[i]) {
+    pos[n++] = i;
+    i += 1 + (unsigned char) d[i];
+  }
+  nh->labels = n;
+  nh->suffix[n] = h;
+  while(n) {
+    --n;
+    h = hashlabel(h, d + pos[n]);
+    nh->suffix[n] = h;
+  }
+}
+
+uint32 hashtype(uint32 h, const char type[2]) {
+  h = (h << 5) + h;
+  h ^= (unsigned char) type[0];
+  h = (h << 5) + h;
+  h ^= (unsigned char) type[1];
+  return h;
+}
+
+/*
+ * Hash any key; for a type and a name this agrees with hashname and hashtype
+ */
+uint32 hashkey(const char *key, unsigned int keylen) {
+  struct namehash nh;
+  unsigned int i;
+  unsigned int n;
+  uint32 h;
+
+  if(keylen >= 3) {
+    i = 2;
+    n = 0;
+    while(i < keylen && key[i] && n < 127) {
+      i += 1 + (unsigned char) key[i];
+      ++n;
+    }
+    if(i == keylen - 1 && !key[i]) {
+      hashname(&nh, key + 2);
+      return hashtype(nh.suffix[0], key);
+    }
+  }
+
+  h = 5381;
+  for(i = 0; i < keylen; ++i) {
+    h = (h << 5) + h;
+    h ^= (unsigned char) key[i];
+  }
+  return h;
+}
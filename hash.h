@@ -1,8 +1,23 @@
 #ifndef HASH_H
 #define HASH_H
 
+#include "uint32.h"
 #include "uint64.h"
 
 extern uint64 hashcode(const char*, const int);
 
+/*
+ * Cache keys are a 2-byte type followed by a lowercased name.
+ * suffix[i] is the hash of the name with its first i labels removed,
+ * so suffix[0] covers the whole name and suffix[labels] the root.
+ */
+struct namehash {
+  unsigned int labels;
+  uint32 suffix[128];
+} ;
+
+extern void hashname(struct namehash *, const char *);
+extern uint32 hashtype(uint32, const char [2]);
+extern uint32 hashkey(const char *, unsigned int);
+
 #endif
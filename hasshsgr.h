@@ -0,0 +1 @@
+/* sysdep: -shortsetgroups */
@@ -0,0 +1,180 @@
+#include <pthread.h>
+#include "alloc.h"
+#include "byte.h"
+#include "case.h"
+#include "dns.h"
+#include "intern.h"
+
+/*
+ * Interned domain names
+ *
+ * The names of name servers recur in query after query: every query below
+ * com. carries the same gtld-servers.net names. Each distinct name is kept
+ * here once, lowercased, under a 4-byte id with a count of its holders.
+ * intern_get returns the id of a name, adding it if needed, and counts one
+ * more holder; intern_put drops one; the name is freed with its last
+ * holder and the id is used again later. 0 is never an id.
+ *
+ * Entries sit in pages that never move, so a holder of an id can read its
+ * name with intern_name without the lock. Everything else is done with
+ * lock held. Buckets double when there are more names than buckets.
+ */
+
+#define PAGE 1024
+#define PAGES 1024
+
+struct entry {
+  char *name; /* 0 when free */
+  unsigned int len;
+  uint32 refs;
+  uint32 hash;
+  uint32 next; /* in the bucket, or in the free list */
+} ;
+
+static struct entry *page[PAGES];
+static uint32 numids = 1; /* ids below have been used */
+static uint32 freeids = 0;
+static uint32 *bucket = 0;
+static uint32 numbuckets = 0;
+static uint32 used = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct entry *entry(uint32 id)
+{
+  return page[id / PAGE] + id % PAGE;
+}
+
+static uint32 hash(const char *d,unsigned int len)
+{
+  uint32 h = 5381;
+  unsigned char ch;
+
+  while (len--) {
+    ch = *d++;
+    if (ch >= 'A' && ch <= 'Z') ch += 32;
+    h = (h << 5) + h;
+    h ^= ch;
+  }
+  return h;
+}
+
+static int grow(void)
+{
+  uint32 *newbucket;
+  uint32 n;
+  uint32 id;
+  struct entry *e;
+
+  n = numbuckets ? numbuckets * 2 : PAGE;
+  newbucket = (uint32 *) alloc(n * sizeof(uint32));
+  if (!newbucket) return 0;
+  byte_zero(newbucket,n * sizeof(uint32));
+
+  for (id = 1;id < numids;++id) {
+    e = entry(id);
+    if (!e->name) continue;
+    e->next = newbucket[e->hash & (n - 1)];
+    newbucket[e->hash & (n - 1)] = id;
+  }
+
+  if (bucket) alloc_free(bucket);
+  bucket = newbucket;
+  numbuckets = n;
+  return 1;
+}
+
+/* 0 if out of memory or ids */
+static uint32 newid(void)
+{
+  uint32 id;
+
+  if (freeids) {
+    id = freeids;
+    freeids = entry(id)->next;
+    return id;
+  }
+  if (numids >= PAGE * PAGES) return 0;
+  id = numids;
+  if (!page[id / PAGE]) {
+    page[id / PAGE] = (struct entry *) alloc(PAGE * sizeof(struct entry));
+    if (!page[id / PAGE]) return 0;
+    byte_zero(page[id / PAGE],PAGE * sizeof(struct entry));
+  }
+  ++numids;
+  return id;
+}
+
+/* Return id of d, 0 on failure */
+uint32 intern_get(const char *d)
+{
+  unsigned int len;
+  uint32 h;
+  uint32 id;
+  struct entry *e;
+  char *name;
+
+  len = dns_domain_length(d);
+  h = hash(d,len);
+
+  pthread_mutex_lock(&lock);
+  if (used >= numbuckets)
+    if (!grow() && !numbuckets) { pthread_mutex_unlock(&lock); return 0; }
+
+  for (id = bucket[h & (numbuckets - 1)];id;id = e->next) {
+    e = entry(id);
+    if ((e->hash == h) && (e->len == len))
+      if (!case_diffb(e->name,len,d)) {
+        ++e->refs;
+        pthread_mutex_unlock(&lock);
+        return id;
+      }
+  }
+
+  name = alloc(len);
+  if (!name) { pthread_mutex_unlock(&lock); return 0; }
+  id = newid();
+  if (!id) { alloc_free(name); pthread_mutex_unlock(&lock); return 0; }
+  byte_copy(name,len,d);
+  case_lowerb(name,len);
+
+  e = entry(id);
+  e->name = name;
+  e->len = len;
+  e->refs = 1;
+  e->hash = h;
+  e->next = bucket[h & (numbuckets - 1)];
+  bucket[h & (numbuckets - 1)] = id;
+  ++used;
+  pthread_mutex_unlock(&lock);
+  return id;
+}
+
+void intern_put(uint32 id)
+{
+  struct entry *e;
+  uint32 *p;
+
+  if (!id) return;
+  pthread_mutex_lock(&lock);
+  e = entry(id);
+  if (!--e->refs) {
+    for (p = bucket + (e->hash & (numbuckets - 1));*p != id;p = &entry(*p)->next) ;
+    *p = e->next;
+    alloc_free(e->name);
+    e->name = 0;
+    e->next = freeids;
+    freeids = id;
+    --used;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+const char *intern_name(uint32 id)
+{
+  return entry(id)->name;
+}
+
+uint32 intern_count(void)
+{
+  return used;
+}
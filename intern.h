@@ -0,0 +1,11 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include "uint32.h"
+
+extern uint32 intern_get(const char *);
+extern void intern_put(uint32);
+extern const char *intern_name(uint32);
+extern uint32 intern_count(void);
+
+#endif
@@ -0,0 +1,97 @@
+#include <sys/epoll.h>
+#include "error.h"
+#include "ioevent.h"
+#include "taia.h"
+#include "uint64.h"
+
+/*
+ * Descriptors are registered once with ioevent_set, together with an id
+ * naming their owner, and stay registered until they are closed or removed
+ * with ioevent_del. ioevent_wait only reports descriptors that are ready, so
+ * the cost of a wakeup follows the activity rather than the number of open
+ * descriptors, and there is no FD_SETSIZE limit.
+ *
+ * The kernel drops a registration when its descriptor is closed. A closed
+ * and reopened descriptor number therefore has to be registered again,
+ * which is why ioevent_set always asks the kernel instead of trusting a copy
+ * of the registration kept here.
+ */
+
+/* one epoll instance per thread, each thread calls ioevent_init */
+static __thread int epfd = -1;
+
+/*
+ * Return 0 on success, -1 on failure
+ */
+int ioevent_init(void)
+{
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd == -1) return -1;
+  return 0;
+}
+
+/*
+ * Add fd or change its events and owner id
+ * Return 0 on success, -1 on failure
+ */
+int ioevent_set(int fd,short events,unsigned int id)
+{
+  struct epoll_event ev;
+
+  if (fd < 0) return -1;
+
+  ev.events = 0;
+  if (events & IOPAUSE_READ) ev.events |= EPOLLIN;
+  if (events & IOPAUSE_WRITE) ev.events |= EPOLLOUT;
+  ev.data.u64 = (((uint64) id) << 32) | (unsigned int) fd;
+
+  if (epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev) == 0) return 0;
+  if (errno != error_exist) return -1;
+  return epoll_ctl(epfd,EPOLL_CTL_MOD,fd,&ev);
+}
+
+void ioevent_del(int fd)
+{
+  struct epoll_event ev;
+
+  if (fd < 0) return;
+  epoll_ctl(epfd,EPOLL_CTL_DEL,fd,&ev);
+}
+
+/*
+ * Wait until a registered fd is ready or until deadline
+ * Return the number of ready descriptors stored in x, at most len
+ */
+int ioevent_wait(struct ioevent *x,unsigned int len,struct taia *deadline,struct taia *stamp)
+{
+  struct epoll_event ev[64];
+  struct taia t;
+  int millisecs;
+  double d;
+  int r;
+  int i;
+
+  if (taia_less(deadline,stamp))
+    millisecs = 0;
+  else {
+    t = *stamp;
+    taia_sub(&t,deadline,&t);
+    d = taia_approx(&t);
+    if (d > 1000.0) d = 1000.0;
+    millisecs = d * 1000.0 + 20.0;
+  }
+
+  if (len > sizeof ev / sizeof ev[0]) len = sizeof ev / sizeof ev[0];
+
+  r = epoll_wait(epfd,ev,len,millisecs);
+  if (r <= 0) return 0;
+
+  for (i = 0;i < r;++i) {
+    x[i].fd = (int) (unsigned int) ev[i].data.u64;
+    x[i].id = ev[i].data.u64 >> 32;
+    x[i].revents = 0;
+    if (ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) x[i].revents |= IOPAUSE_READ;
+    if (ev[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) x[i].revents |= IOPAUSE_WRITE;
+  }
+  return r;
+}
@@ -0,0 +1,20 @@
+#ifndef IOEVENT_H
+#define IOEVENT_H
+
+/* epoll counterpart of iopause with persistent registrations */
+
+#include "iopause.h"
+#include "taia.h"
+
+struct ioevent {
+  int fd;
+  unsigned int id;
+  short revents; /* IOPAUSE_READ, IOPAUSE_WRITE */
+} ;
+
+extern int ioevent_init(void);
+extern int ioevent_set(int,short,unsigned int);
+extern void ioevent_del(int);
+extern int ioevent_wait(struct ioevent *,unsigned int,struct taia *,struct taia *);
+
+#endif
@@ -1,13 +1,52 @@
-#include "buffer.h"
+#include <unistd.h>
 #include "uint32.h"
 #include "uint16.h"
 #include "error.h"
 #include "byte.h"
+#include "str.h"
 #include "log.h"
+#include "intern.h"
+
+/*
+Each thread assembles its lines in its own buffer and hands every line
+to the kernel with one write, so lines from different threads never mix
+*/
+static __thread char out[4096];
+static __thread unsigned int outlen = 0;
+
+static void flush(void)
+{
+  unsigned int pos;
+  int w;
+
+  for (pos = 0;pos < outlen;pos += w) {
+    w = write(2,out + pos,outlen - pos);
+    if (w == -1) {
+      if (errno == error_intr) { w = 0; continue; }
+      break;
+    }
+  }
+  outlen = 0;
+}
+
+static void put(const char *buf,unsigned int len)
+{
+  unsigned int n;
+
+  while (len) {
+    if (outlen == sizeof out) flush();
+    n = sizeof out - outlen;
+    if (n > len) n = len;
+    byte_copy(out + outlen,n,buf);
+    outlen += n;
+    buf += n;
+    len -= n;
+  }
+}
 
 /* work around gcc 2.95.2 bug */
 #define number(x) ( (u64 = (x)), u64_print() )
-static uint64 u64;
+static __thread uint64 u64;
 static void u64_print(void)
 {
   char buf[20];
@@ -20,24 +59,24 @@ static void u64_print(void)
     u64 /= 10;
   } while(u64);
 
-  buffer_put(buffer_2,buf + pos,sizeof buf - pos);
+  put(buf + pos,sizeof buf - pos);
 }
 
 static void hex(unsigned char c)
 {
-  buffer_put(buffer_2,"0123456789abcdef" + (c >> 4),1);
-  buffer_put(buffer_2,"0123456789abcdef" + (c & 15),1);
+  put("0123456789abcdef" + (c >> 4),1);
+  put("0123456789abcdef" + (c & 15),1);
 }
 
 static void string(const char *s)
 {
-  buffer_puts(buffer_2,s);
+  put(s,str_len(s));
 }
 
 static void line(void)
 {
   string("\n");
-  buffer_flush(buffer_2);
+  flush();
 }
 
 static void space(void)
@@ -82,7 +121,7 @@ static void name(const char *q)
       --state;
       if ((ch <= 32) || (ch > 126)) ch = '?';
       if ((ch >= 'A') && (ch <= 'Z')) ch += 32;
-      buffer_put(buffer_2,&ch,1);
+      put(&ch,1);
     }
     string(".");
   }
@@ -119,6 +158,13 @@ void log_querydrop(uint64 *qnum)
   line();
 }
 
+void log_querywait(uint64 *qnum,uint64 *leader)
+{
+  string("wait "); number(*qnum); space();
+  number(*leader);
+  line();
+}
+
 void log_tcpopen(const char client[4],unsigned int port)
 {
   string("tcpopen ");
@@ -157,6 +203,13 @@ void log_cachedanswer(const char *q,const char type[2])
   line();
 }
 
+void log_cachedpacket(const char *q,const char type[2])
+{
+  string("cached packet "); logtype(type); space();
+  name(q);
+  line();
+}
+
 void log_cachedcname(const char *dn,const char *dn2)
 {
   string("cached cname "); name(dn); space(); name(dn2);
@@ -175,6 +228,12 @@ void log_cachednxdomain(const char *dn)
   line();
 }
 
+void log_purge(const char *dn)
+{
+  string("purge "); name(dn);
+  line();
+}
+
 void log_nxdomain(const char server[4],const char *q,unsigned int ttl)
 {
   string("nxdomain "); ip(server); space(); number(ttl); space();
@@ -278,11 +337,14 @@ void log_stats(void)
   extern uint64 cache_motion;
   extern int uactive;
   extern int tactive;
+  extern uint64 save_large;
 
   string("stats ");
   number(numqueries); space();
   number(cache_motion); space();
   number(uactive); space();
-  number(tactive);
+  number(tactive); space();
+  number(save_large); space();
+  number(intern_count());
   line();
 }
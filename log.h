@@ -8,14 +8,17 @@ extern void log_startup(void);
 extern void log_query(uint64 *,const char *,unsigned int,const char *,const char *,const char *);
 extern void log_querydrop(uint64 *);
 extern void log_querydone(uint64 *,unsigned int);
+extern void log_querywait(uint64 *,uint64 *);
 
 extern void log_tcpopen(const char *,unsigned int);
 extern void log_tcpclose(const char *,unsigned int);
 
 extern void log_cachedanswer(const char *,const char *);
+extern void log_cachedpacket(const char *,const char *);
 extern void log_cachedcname(const char *,const char *);
 extern void log_cachednxdomain(const char *);
 extern void log_cachedns(const char *,const char *);
+extern void log_purge(const char *);
 
 extern void log_tx(const char *,const char *,const char *,const char *,unsigned int);
 
@@ -0,0 +1,170 @@
+#include <pthread.h>
+#include "alloc.h"
+#include "byte.h"
+#include "dns.h"
+#include "nscache.h"
+#include "tai.h"
+#include "uint32.h"
+
+/*
+ * Delegation cache for NS records and the addresses of name servers
+ *
+ * query.c stores every NS RRset and every A RRset that names a server,
+ * here as well as in the main cache, with the same keys and key hashes:
+ * 2-byte type and lowercased name. Ordinary answers never enter this
+ * table, so a flood of unique names cannot push out the delegations for
+ * the root's children and resolution does not restart from the root.
+ *
+ * The table is open addressed with NSCACHE_PROBE slots per key. A new entry
+ * takes an unused or expired slot, otherwise the slot of the zone with the
+ * most labels, as long as that is not closer to the root than the new one.
+ * Entries expire with their TTL.
+ *
+ * Worker threads share the table; it is only touched with lock held, and
+ * nscache_get copies data into a buffer of the calling thread.
+ */
+
+#define NSCACHE_PROBE 8
+#define NSCACHE_MAXKEYLEN 257
+#define NSCACHE_MAXDATALEN 512
+
+struct nsentry {
+  struct tai expire;
+  unsigned int keylen; /* 0 when unused */
+  unsigned int datalen;
+  unsigned int labels;
+  char key[NSCACHE_MAXKEYLEN];
+  char data[NSCACHE_MAXDATALEN];
+} ;
+
+static struct nsentry *table = 0;
+static unsigned int numslots = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread char copy[NSCACHE_MAXDATALEN];
+
+static unsigned int labels(const char *key,unsigned int keylen)
+{
+  unsigned int pos = 2;
+  unsigned int n = 0;
+
+  while ((pos < keylen) && key[pos]) {
+    pos += 1 + (unsigned char) key[pos];
+    ++n;
+  }
+  return n;
+}
+
+static int unused(struct nsentry *e,struct tai *now)
+{
+  return !e->keylen || tai_less(&e->expire,now);
+}
+
+void nscache_set(const char *key,unsigned int keylen,uint32 h,const char *data,unsigned int datalen,uint32 ttl)
+{
+  struct nsentry *e;
+  struct nsentry *same = 0;
+  struct nsentry *empty = 0;
+  struct nsentry *deep = 0;
+  struct tai now;
+  struct tai expire;
+  unsigned int n;
+  unsigned int i;
+
+  if (!numslots) return;
+  if (keylen > NSCACHE_MAXKEYLEN) return;
+  if (datalen > NSCACHE_MAXDATALEN) return;
+  if (!ttl) return;
+
+  n = labels(key,keylen);
+  tai_now(&now);
+  tai_uint(&expire,ttl);
+  tai_add(&expire,&expire,&now);
+
+  pthread_mutex_lock(&lock);
+  for (i = 0;i < NSCACHE_PROBE;++i) {
+    e = table + ((h + i) & (numslots - 1));
+    if ((e->keylen == keylen) && byte_equal(e->key,keylen,key)) { same = e; break; }
+    if (unused(e,&now)) { if (!empty) empty = e; }
+    else if (!deep || (e->labels > deep->labels)) deep = e;
+  }
+
+  e = same;
+  if (!e) e = empty;
+  if (!e && (deep->labels >= n)) e = deep;
+  if (e) {
+    byte_copy(e->key,keylen,key);
+    e->keylen = keylen;
+    byte_copy(e->data,datalen,data);
+    e->datalen = datalen;
+    e->labels = n;
+    e->expire = expire;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+char *nscache_get(const char *key,unsigned int keylen,uint32 h,unsigned int *datalen,uint32 *ttl)
+{
+  struct nsentry *e;
+  struct tai now;
+  struct tai left;
+  unsigned int i;
+  double d;
+
+  if (!numslots) return 0;
+  if (keylen > NSCACHE_MAXKEYLEN) return 0;
+
+  tai_now(&now);
+
+  pthread_mutex_lock(&lock);
+  for (i = 0;i < NSCACHE_PROBE;++i) {
+    e = table + ((h + i) & (numslots - 1));
+    if (e->keylen != keylen || byte_diff(e->key,keylen,key)) continue;
+    if (tai_less(&e->expire,&now)) break;
+
+    tai_sub(&left,&e->expire,&now);
+    d = tai_approx(&left);
+    if (d > 604800) d = 604800;
+    *ttl = d;
+    byte_copy(copy,e->datalen,e->data);
+    *datalen = e->datalen;
+    pthread_mutex_unlock(&lock);
+    return copy;
+  }
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+/*
+ * Drop the entries for d and for the names below it
+ * The table is small enough to scan
+ */
+void nscache_purge(const char *d)
+{
+  unsigned int i;
+
+  pthread_mutex_lock(&lock);
+  for (i = 0;i < numslots;++i)
+    if (table[i].keylen > 2)
+      if (dns_domain_suffix(table[i].key + 2,d))
+        table[i].keylen = 0;
+  pthread_mutex_unlock(&lock);
+}
+
+/*
+ * size in bytes, 0 disables the table
+ * Return 1 on success, 0 on failure
+ */
+int nscache_init(unsigned long size)
+{
+  unsigned int n;
+
+  numslots = 0;
+  n = size / sizeof(struct nsentry);
+  if (!n) return 1;
+
+  for (numslots = 1;numslots * 2 <= n;numslots *= 2) ;
+  table = (struct nsentry *) alloc(numslots * sizeof(struct nsentry));
+  if (!table) { numslots = 0; return 0; }
+  byte_zero(table,numslots * sizeof(struct nsentry));
+  return 1;
+}
@@ -0,0 +1,11 @@
+#ifndef NSCACHE_H
+#define NSCACHE_H
+
+#include "uint32.h"
+
+extern int nscache_init(unsigned long);
+extern void nscache_set(const char *,unsigned int,uint32,const char *,unsigned int,uint32);
+extern char *nscache_get(const char *,unsigned int,uint32,unsigned int *,uint32 *);
+extern void nscache_purge(const char *);
+
+#endif
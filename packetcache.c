@@ -0,0 +1,285 @@
+#include <pthread.h>
+#include "alloc.h"
+#include "byte.h"
+#include "case.h"
+#include "dns.h"
+#include "packetcache.h"
+#include "response.h"
+#include "tai.h"
+#include "uint16.h"
+#include "uint32.h"
+
+/*
+ * Full-response cache in front of query.c
+ *
+ * Entries are keyed on qtype, qclass and the lowercased qname, and hold the
+ * final wire-format response built by response.c along with the offset of
+ * every TTL field in it. A hit is copied straight back into response[], with
+ * the client's spelling of the qname and TTLs aged by the time spent in the
+ * cache, so the caller only has to patch the ID and send.
+ *
+ * The table is direct mapped, a new entry replaces whatever occupied its slot.
+ * An entry expires together with the smallest TTL in its response. The bytes
+ * held by entries are counted; when a new entry takes the total past the
+ * size given to packetcache_init, a clock hand sweeping the table frees
+ * other entries until it fits again.
+ *
+ * Worker threads share the table; slot[] is only touched with lock held.
+ */
+
+#define MAXENTRYLEN 4096
+#define MAXRECORDS 512
+
+struct packetentry {
+  struct tai stored;
+  struct tai expire;
+  unsigned int keylen;
+  unsigned int len;
+  unsigned int numttls;
+  unsigned int size; /* bytes allocated for the entry */
+  unsigned int *ttlpos; /* offsets of the TTL fields in data */
+  char *key;
+  char *data;
+};
+
+static struct packetentry **slot = 0;
+static unsigned int numslots = 0;
+static unsigned long used = 0; /* bytes in entries */
+static unsigned long limit = 0;
+static unsigned int hand = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int hash(const char *key,unsigned int keylen)
+{
+  unsigned int result = 5381;
+
+  while (keylen) {
+    result = (result << 5) + result;
+    result ^= (unsigned char) *key;
+    ++key;
+    --keylen;
+  }
+  return result & (numslots - 1);
+}
+
+/*
+ * 2-byte qtype; 2-byte qclass; lowercased qname
+ * Return key length, 0 if the name is too long to be cached
+ */
+static unsigned int makekey(char key[259],const char *q,const char qtype[2],const char qclass[2])
+{
+  unsigned int len;
+
+  len = dns_domain_length(q);
+  if (len > 255) return 0;
+
+  byte_copy(key,2,qtype);
+  byte_copy(key + 2,2,qclass);
+  byte_copy(key + 4,len,q);
+  case_lowerb(key + 4,len);
+  return len + 4;
+}
+
+static void entryfree(unsigned int h)
+{
+  if (!slot[h]) return;
+  used -= slot[h]->size;
+  alloc_free((char *) slot[h]);
+  slot[h] = 0;
+}
+
+/*
+ * Look for a cached response to the question
+ * Return 1 and leave the response in response[] on a hit, 0 otherwise
+ */
+int packetcache_get(const char *q,const char qtype[2],const char qclass[2])
+{
+  char key[259];
+  unsigned int keylen;
+  unsigned int h;
+  unsigned int i;
+  struct packetentry *e;
+  struct tai now;
+  struct tai age;
+  uint32 elapsed;
+  uint32 ttl;
+
+  if (!numslots) return 0;
+
+  keylen = makekey(key,q,qtype,qclass);
+  if (!keylen) return 0;
+
+  h = hash(key,keylen);
+  tai_now(&now);
+
+  pthread_mutex_lock(&lock);
+  e = slot[h];
+  if (!e || (e->keylen != keylen) || byte_diff(e->key,keylen,key)) {
+    pthread_mutex_unlock(&lock);
+    return 0;
+  }
+  if (!tai_less(&now,&e->expire)) {
+    entryfree(h);
+    pthread_mutex_unlock(&lock);
+    return 0;
+  }
+  tai_sub(&age,&now,&e->stored);
+  elapsed = tai_approx(&age);
+
+  response_len = 0;
+  if (!response_addbytes(e->data,e->len)) {
+    pthread_mutex_unlock(&lock);
+    return 0;
+  }
+
+  // question name is never compressed, echo the client's spelling of it
+  byte_copy(response + 12,keylen - 4,q);
+
+  for (i = 0;i < e->numttls;++i) {
+    uint32_unpack_big(response + e->ttlpos[i],&ttl);
+    ttl = (ttl > elapsed) ? ttl - elapsed : 0;
+    uint32_pack_big(response + e->ttlpos[i],ttl);
+  }
+  pthread_mutex_unlock(&lock);
+
+  return 1;
+}
+
+/*
+ * Remember the response currently in response[]
+ * Only complete NOERROR responses carrying at least one answer are kept,
+ * anything else has no TTL the entry could expire with
+ */
+void packetcache_set(void)
+{
+  char key[259];
+  char header[12];
+  char misc[10];
+  unsigned int ttlpos[MAXRECORDS];
+  unsigned int numttls;
+  unsigned int numrecords;
+  unsigned int keylen;
+  unsigned int pos;
+  unsigned int qend;
+  unsigned int h;
+  unsigned int size;
+  uint16 num;
+  uint16 datalen;
+  uint32 ttl;
+  uint32 minttl;
+  struct packetentry *e;
+  char *x;
+
+  if (!numslots) return;
+  if (response_len > MAXENTRYLEN) return;
+
+  pos = dns_packet_copy(response,response_len,0,header,12); if (!pos) return;
+  if (header[2] & 2) return; /* truncated */
+  if (header[3] & 15) return;
+
+  uint16_unpack_big(header + 6,&num);
+  if (!num) return;
+  numrecords = num;
+  uint16_unpack_big(header + 8,&num);
+  numrecords += num;
+  uint16_unpack_big(header + 10,&num);
+  numrecords += num;
+  if (numrecords > MAXRECORDS) return;
+
+  qend = dns_packet_skipname(response,response_len,pos); if (!qend) return;
+  if (qend - pos != dns_domain_length(response + pos)) return;
+  if (qend - pos > 255) return;
+  if (qend + 4 > response_len) return;
+
+  byte_copy(key,4,response + qend);
+  byte_copy(key + 4,qend - pos,response + pos);
+  case_lowerb(key + 4,qend - pos);
+  keylen = qend - pos + 4;
+
+  /*
+   * Each record: name; 2-byte type; 2-byte class; 4-byte ttl; 2-byte datalen; data
+   */
+  pos = qend + 4;
+  minttl = 604800;
+  for (numttls = 0;numttls < numrecords;++numttls) {
+    pos = dns_packet_skipname(response,response_len,pos); if (!pos) return;
+    ttlpos[numttls] = pos + 4;
+    pos = dns_packet_copy(response,response_len,pos,misc,10); if (!pos) return;
+    uint32_unpack_big(misc + 4,&ttl);
+    if (ttl < minttl) minttl = ttl;
+    uint16_unpack_big(misc + 8,&datalen);
+    if (datalen > response_len - pos) return;
+    pos += datalen;
+  }
+  if (!minttl) return;
+
+  size = sizeof(struct packetentry) + numttls * sizeof(unsigned int) + keylen + response_len;
+  if (size > limit) return;
+  x = alloc(size);
+  if (!x) return;
+  e = (struct packetentry *) x;
+  e->ttlpos = (unsigned int *) (x + sizeof(struct packetentry));
+  e->key = x + sizeof(struct packetentry) + numttls * sizeof(unsigned int);
+  e->data = e->key + keylen;
+
+  tai_now(&e->stored);
+  tai_uint(&e->expire,minttl);
+  tai_add(&e->expire,&e->expire,&e->stored);
+  e->keylen = keylen;
+  e->len = response_len;
+  e->numttls = numttls;
+  e->size = size;
+  byte_copy(e->ttlpos,numttls * sizeof(unsigned int),ttlpos);
+  byte_copy(e->key,keylen,key);
+  byte_copy(e->data,response_len,response);
+
+  h = hash(key,keylen);
+  pthread_mutex_lock(&lock);
+  entryfree(h);
+  slot[h] = e;
+  used += size;
+  while (used > limit) {
+    hand = (hand + 1) & (numslots - 1);
+    if (hand != h) entryfree(hand);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Drop the responses to questions about d and the names below it
+ */
+void packetcache_purge(const char *d)
+{
+  unsigned int h;
+
+  pthread_mutex_lock(&lock);
+  for (h = 0;h < numslots;++h)
+    if (slot[h] && dns_domain_suffix(slot[h]->key + 4,d))
+      entryfree(h);
+  pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Keep at most cachesize bytes of responses, plus the slot table
+ * A cachesize under 1024 disables the packet cache
+ * Return 1 on success, 0 on failure
+ */
+int packetcache_init(unsigned long cachesize)
+{
+  unsigned int n;
+
+  numslots = 0;
+  if (cachesize > 1000000000) cachesize = 1000000000;
+  if (cachesize < 1024) return 1;
+
+  n = 1;
+  while (n <= (cachesize >> 9)) n <<= 1;
+
+  slot = (struct packetentry **) alloc(n * sizeof(struct packetentry *));
+  if (!slot) return 0;
+  byte_zero(slot,n * sizeof(struct packetentry *));
+
+  numslots = n;
+  limit = cachesize;
+  return 1;
+}
@@ -0,0 +1,9 @@
+#ifndef PACKETCACHE_H
+#define PACKETCACHE_H
+
+extern int packetcache_init(unsigned long);
+extern int packetcache_get(const char *,const char *,const char *);
+extern void packetcache_set(void);
+extern void packetcache_purge(const char *);
+
+#endif
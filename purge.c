@@ -0,0 +1,97 @@
+#include "alloc.h"
+#include "byte.h"
+#include "cachewrapper.h"
+#include "dns.h"
+#include "log.h"
+#include "nscache.h"
+#include "openreadclose.h"
+#include "packetcache.h"
+#include "probefile.h"
+#include "purge.h"
+#include "serverstate.h"
+#include "sleep.h"
+#include "str.h"
+#include "stralloc.h"
+
+/*
+ * The file named by $PURGE has one domain name per line. Whenever it
+ * changes, everything cached for those names and for the names below
+ * them is dropped: from the main cache with one walk down its label
+ * tree, from the delegation and packet caches by scanning them.
+ * Rewriting the file with the same names purges them again.
+ */
+
+static time_t lastmodificationtime = 0;
+static char* purgepath = 0;
+static stralloc file;
+
+static void purgename(const char *s, unsigned int len) {
+  char *d = 0;
+
+  while(len && (s[len - 1] == ' ' || s[len - 1] == '\t' || s[len - 1] == '\r')) --len;
+  while(len && (*s == ' ' || *s == '\t')) { ++s; --len; }
+  if(!len) {
+    return;
+  }
+  if(!dns_domain_fromdot(&d, s, len)) {
+    return;
+  }
+
+  cache_purge_wrapper(d);
+  nscache_purge(d);
+  packetcache_purge(d);
+  log_purge(d);
+  alloc_free(d);
+}
+
+static void purgefile() {
+  unsigned int i;
+  unsigned int j;
+
+  if(openreadclose(purgepath, &file, 1024) != 1) {
+    return;
+  }
+  for(i = 0; i < file.len; i = j + 1) {
+    j = i + byte_chr(file.s + i, file.len - i, '\n');
+    purgename(file.s + i, j - i);
+  }
+}
+
+/*
+ * Thread invoked during dnscache startup to watch the purge file
+ */
+void* updatePurge(void *dummyparam) {
+  if(!purgepath) {
+    return 0;
+  }
+  probefile(purgepath, &lastmodificationtime); // names already there are not news
+  while(keepRunning == 1) {
+    sleepinseconds(2);
+    if(probefile(purgepath, &lastmodificationtime)) {
+      purgefile();
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Initialize purge by providing the path of the purge file
+ * Return 1 if successful -1 in case of failure
+ */
+int initializepurge(const char *path) {
+  int len;
+
+  if(!path || purgepath) {
+    return -1;
+  }
+
+  len = str_len(path) + 1;
+  purgepath = alloc(len);
+  if(!purgepath) {
+    return -1;
+  }
+  byte_copy(purgepath, len, path);
+
+  return 1;
+}
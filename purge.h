@@ -0,0 +1,7 @@
+#ifndef PURGE_H
+#define PURGE_H
+
+extern int initializepurge(const char *);
+extern void* updatePurge(void *);
+
+#endif
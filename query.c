@@ -9,8 +9,12 @@
 #include "uint32.h"
 #include "uint16.h"
 #include "dd.h"
+#include "hash.h"
+#include "intern.h"
 #include "alloc.h"
 #include "response.h"
+#include "packetcache.h"
+#include "nscache.h"
 #include "query.h"
 
 static int flagforwardonly = 0;
@@ -32,31 +36,52 @@ static void cachegeneric(const char type[2],const char *d,const char *data,unsig
   byte_copy(key + 2,len,d);
   case_lowerb(key + 2,len);
 
-  cache_set_wrapper(key,len + 2,data,datalen,ttl);
+  cache_set_wrapper(key,len + 2,hashkey(key,len + 2),data,datalen,ttl);
 }
 
-static char save_buf[8192];
-static unsigned int save_len;
-static unsigned int save_ok;
+/*
+An RRset is assembled in save, which grows as needed and stays with the
+thread, so any RRset a reply can carry gets cached. save_large counts the
+ones over the 8192 bytes of the fixed buffer this used to be; those were
+dropped and fetched again on every query.
+*/
+static __thread stralloc save = {0};
+static __thread unsigned int save_ok;
+uint64 save_large = 0;
 
 static void save_start(void)
 {
-  save_len = 0;
+  save.len = 0;
   save_ok = 1;
 }
 
 static void save_data(const char *buf,unsigned int len)
 {
   if (!save_ok) return;
-  if (len > (sizeof save_buf) - save_len) { save_ok = 0; return; }
-  byte_copy(save_buf + save_len,len,buf);
-  save_len += len;
+  if (!stralloc_catb(&save,buf,len)) save_ok = 0;
 }
 
 static void save_finish(const char type[2],const char *d,uint32 ttl)
 {
   if (!save_ok) return;
-  cachegeneric(type,d,save_buf,save_len,ttl);
+  if (save.len > 8192) __sync_fetch_and_add(&save_large,1);
+  cachegeneric(type,d,save.s,save.len,ttl);
+}
+
+/* also keep the saved delegation data where answers cannot evict it */
+static void save_infra(const char type[2],const char *d,uint32 ttl)
+{
+  unsigned int len;
+  char key[257];
+
+  if (!save_ok) return;
+  len = dns_domain_length(d);
+  if (len > 255) return;
+
+  byte_copy(key,2,type);
+  byte_copy(key + 2,len,d);
+  case_lowerb(key + 2,len);
+  nscache_set(key,len + 2,hashkey(key,len + 2),save.s,save.len,ttl);
 }
 
 
@@ -76,37 +101,82 @@ static uint32 ttlget(char buf[4])
 }
 
 
+static void subfree(struct query *z)
+{
+  int j;
+
+  for (j = 0;j < QUERY_MAXSUB;++j)
+    if (z->sub[j]) {
+      query_free(z->sub[j]);
+      z->sub[j] = 0;
+    }
+}
+
+static int waiting(struct query *z)
+{
+  int j;
+
+  for (j = 0;j < QUERY_MAXSUB;++j)
+    if (z->sub[j]) return 1;
+  return 0;
+}
+
+static void nsdrop(struct querylevel *lv,int j)
+{
+  intern_put(lv->ns[j]);
+  lv->ns[j] = 0;
+}
+
+static void nsclear(struct querylevel *lv)
+{
+  int j;
+
+  for (j = 0;j < QUERY_MAXNS;++j)
+    nsdrop(lv,j);
+}
+
 static void cleanup(struct query *z)
 {
   int j;
-  int k;
 
+  subfree(z);
   dns_transmit_free(&z->dt);
-  for (j = 0;j < QUERY_MAXALIAS;++j)
-    dns_domain_free(&z->alias[j]);
-  for (j = 0;j < QUERY_MAXLEVEL;++j) {
-    dns_domain_free(&z->name[j]);
-    for (k = 0;k < QUERY_MAXNS;++k)
-      dns_domain_free(&z->ns[j][k]);
-  }
+  for (j = 0;j < QUERY_MAXLEVEL;++j)
+    if (z->lv[j]) {
+      nsclear(z->lv[j]);
+      z->lv[j] = 0;
+    }
+  z->alias = 0;
+  arena_reset(&z->arena);
+}
+
+/* state for level i, from the arena the first time the query needs it */
+static int levelstart(struct query *z,unsigned int i)
+{
+  if (z->lv[i]) return 1;
+  z->lv[i] = (struct querylevel *) arena_alloc(&z->arena,sizeof(struct querylevel));
+  if (!z->lv[i]) return 0;
+  byte_zero(z->lv[i],sizeof(struct querylevel));
+  return 1;
 }
 
 static int rqa(struct query *z)
 {
   int i;
 
-  for (i = QUERY_MAXALIAS - 1;i >= 0;--i)
-    if (z->alias[i]) {
-      if (!response_query(z->alias[i],z->type,z->class)) return 0;
-      while (i > 0) {
-        if (!response_cname(z->alias[i],z->alias[i - 1],z->aliasttl[i])) return 0;
-        --i;
+  if (z->alias)
+    for (i = QUERY_MAXALIAS - 1;i >= 0;--i)
+      if (z->alias->name[i]) {
+        if (!response_query(z->alias->name[i],z->type,z->class)) return 0;
+        while (i > 0) {
+          if (!response_cname(z->alias->name[i],z->alias->name[i - 1],z->alias->ttl[i])) return 0;
+          --i;
+        }
+        if (!response_cname(z->alias->name[0],z->lv[0]->name,z->alias->ttl[0])) return 0;
+        return 1;
       }
-      if (!response_cname(z->alias[0],z->name[0],z->aliasttl[0])) return 0;
-      return 1;
-    }
 
-  if (!response_query(z->name[0],z->type,z->class)) return 0;
+  if (!response_query(z->lv[0]->name,z->type,z->class)) return 0;
   return 1;
 }
 
@@ -120,59 +190,343 @@ static int globalip(char *d,char ip[4])
   return 0;
 }
 
-static char *t1 = 0;
-static char *t2 = 0;
-static char *t3 = 0;
-static char *cname = 0;
-static char *referral = 0;
-static unsigned int *records = 0;
+/* scratch space of doit(), one copy per thread */
+static __thread char t1[255];
+static __thread char t2[255];
+static __thread char t3[255];
+static __thread char cname[255];
+static __thread char referral[255];
+static __thread struct namehash dh; /* of d, for its own and its ancestors' keys */
+
+/*
+A reply is parsed once into rr[], in packet order: where each owner name
+and each record header starts, and a hash of the lowercased owner. The
+names stay compressed in the packet. records[] then orders rr[] by type,
+owner and position, so each RRset is a run; comparing owners costs a hash
+comparison unless the hashes are equal. Both arrays are kept for the next
+reply and only grow.
+*/
+struct rr {
+  unsigned int name;
+  unsigned int pos; /* type, class, ttl, data length, data */
+  uint32 hash;
+} ;
+static __thread struct rr *rr = 0;
+static __thread unsigned int *records = 0;
+static __thread unsigned int rrmax = 0;
+
+static int rrspace(unsigned int n)
+{
+  if (n <= rrmax) return 1;
+  if (n < 64) n = 64;
+  if (rr) alloc_free(rr);
+  if (records) alloc_free(records);
+  rrmax = 0;
+  records = 0;
+  rr = (struct rr *) alloc(n * sizeof(struct rr));
+  if (!rr) return 0;
+  records = (unsigned int *) alloc(n * sizeof(unsigned int));
+  if (!records) return 0;
+  rrmax = n;
+  return 1;
+}
+
+static uint32 namehash(const char *d)
+{
+  unsigned int len;
+  unsigned char ch;
+  uint32 h = 5381;
 
-static int smaller(char *buf,unsigned int len,unsigned int pos1,unsigned int pos2)
+  len = dns_domain_length(d);
+  while (len--) {
+    ch = *d++;
+    if (ch >= 'A' && ch <= 'Z') ch += 32;
+    h = (h << 5) + h;
+    h ^= ch;
+  }
+  return h;
+}
+
+/* order two names in buf that the parser has already expanded once */
+static int namediff(const char *buf,unsigned int pos1,unsigned int pos2)
 {
-  char header1[12];
-  char header2[12];
+  unsigned char c1;
+  unsigned char c2;
   int r;
-  unsigned int len1;
-  unsigned int len2;
 
-  pos1 = dns_packet_getname(buf,len,pos1,&t1);
-  dns_packet_copy(buf,len,pos1,header1,10);
-  pos2 = dns_packet_getname(buf,len,pos2,&t2);
-  dns_packet_copy(buf,len,pos2,header2,10);
+  for (;;) {
+    while ((unsigned char) buf[pos1] >= 192)
+      pos1 = ((buf[pos1] & 63) << 8) + (unsigned char) buf[pos1 + 1];
+    while ((unsigned char) buf[pos2] >= 192)
+      pos2 = ((buf[pos2] & 63) << 8) + (unsigned char) buf[pos2 + 1];
+    if (pos1 == pos2) return 0;
+    c1 = buf[pos1];
+    c2 = buf[pos2];
+    if (c1 != c2) return ((int) c1) - ((int) c2);
+    if (!c1) return 0;
+    r = case_diffb(buf + pos1 + 1,c1,buf + pos2 + 1);
+    if (r) return r;
+    pos1 += 1 + c1;
+    pos2 += 1 + c2;
+  }
+}
 
-  r = byte_diff(header1,4,header2);
-  if (r < 0) return 1;
-  if (r > 0) return 0;
+static int samerrset(const char *buf,unsigned int i,unsigned int j)
+{
+  if (byte_diff(buf + rr[i].pos,4,buf + rr[j].pos)) return 0;
+  if (rr[i].hash != rr[j].hash) return 0;
+  return !namediff(buf,rr[i].name,rr[j].name);
+}
 
-  len1 = dns_domain_length(t1);
-  len2 = dns_domain_length(t2);
-  if (len1 < len2) return 1;
-  if (len1 > len2) return 0;
+static int smaller(const char *buf,unsigned int i,unsigned int j)
+{
+  int r;
+
+  r = byte_diff(buf + rr[i].pos,4,buf + rr[j].pos);
+  if (r) return r < 0;
+  if (rr[i].hash != rr[j].hash) return rr[i].hash < rr[j].hash;
+  r = namediff(buf,rr[i].name,rr[j].name);
+  if (r) return r < 0;
+  return i < j;
+}
+
+/*
+A name behind CNAMEs is answered from the cache in one probe. Once a
+query ends in such a chain and an RRset, the answer section is cached
+as it sits in response[], under the qtype and the original name followed
+by a byte no ordinary key ends with, for the smallest TTL in it. The
+question has the same length for any spelling of the name, so the
+compression pointers in the saved section stay valid in a new response.
+*/
+static __thread int flagchainhit = 0; /* response came from chain_get */
+
+static unsigned int chainkey(char *key,const char type[2],const char *d)
+{
+  unsigned int len;
+
+  len = dns_domain_length(d);
+  if (len > 254) return 0;
+  byte_copy(key,2,type);
+  byte_copy(key + 2,len,d);
+  case_lowerb(key + 2,len);
+  key[len + 2] = '\377';
+  return len + 3;
+}
+
+static void chain_save(void)
+{
+  char key[258];
+  unsigned int keylen;
+  unsigned int start;
+  unsigned int pos;
+  uint16 numanswers;
+  uint16 datalen;
+  uint32 ttl;
+  uint32 minttl;
+  int flagcname;
+  int j;
+
+  if (flagchainhit) { flagchainhit = 0; return; }
+  if (response_len < 12) return;
+  if (response[3] & 15) return;
+  uint16_unpack_big(response + 6,&numanswers);
+  if (numanswers < 2) return;
 
-  r = case_diffb(t1,len1,t2);
-  if (r < 0) return 1;
-  if (r > 0) return 0;
+  pos = dns_packet_name(response,response_len,12,t1); if (!pos) return;
+  if (pos + 4 > response_len) return;
+  if (typematch(DNS_T_CNAME,response + pos)) return;
+  keylen = chainkey(key,response + pos,t1); if (!keylen) return;
+  start = pos + 4;
 
-  if (pos1 < pos2) return 1;
+  minttl = 604800;
+  flagcname = 0;
+  pos = start;
+  for (j = 0;j < numanswers;++j) {
+    pos = dns_packet_skipname(response,response_len,pos); if (!pos) return;
+    if (pos + 10 > response_len) return;
+    flagcname = byte_equal(response + pos,2,DNS_T_CNAME);
+    if (!j && !flagcname) return;
+    ttl = ttlget(response + pos + 4);
+    if (ttl < minttl) minttl = ttl;
+    uint16_unpack_big(response + pos + 8,&datalen);
+    pos += 10 + datalen;
+    if (pos > response_len) return;
+  }
+  if (flagcname) return;
+
+  save_start();
+  save_data(response + 6,2);
+  save_data(response + start,pos - start);
+  if (save_ok) cache_set_wrapper(key,keylen,hashkey(key,keylen),save.s,save.len,minttl);
+}
+
+/* Return 1 if response[] now holds the cached chain for z, 0 if none, -1 on error */
+static int chain_get(struct query *z)
+{
+  char key[258];
+  unsigned int keylen;
+  char *cached;
+  unsigned int cachedlen;
+  unsigned int pos;
+  uint16 numanswers;
+  uint16 datalen;
+  uint32 ttl;
+
+  keylen = chainkey(key,z->type,z->lv[0]->name); if (!keylen) return 0;
+  cached = cache_get_wrapper(key,keylen,hashkey(key,keylen),&cachedlen,&ttl);
+  if (!cached || (cachedlen < 2)) return 0;
+
+  if (!response_query(z->lv[0]->name,z->type,z->class)) return -1;
+  pos = response_len;
+  if (!response_addbytes(cached + 2,cachedlen - 2)) return -1;
+  byte_copy(response + 6,2,cached);
+
+  uint16_unpack_big(cached,&numanswers);
+  while (numanswers--) {
+    pos = dns_packet_skipname(response,response_len,pos); if (!pos) return -1;
+    if (pos + 10 > response_len) return -1;
+    uint32_pack_big(response + pos + 4,response_ttl(ttl));
+    uint16_unpack_big(response + pos + 8,&datalen);
+    pos += 10 + datalen;
+  }
+  flagchainhit = 1;
+  return 1;
+}
+
+static void addserver(char servers[64],const char ip[4])
+{
+  int k;
+
+  for (k = 0;k < 64;k += 4)
+    if (byte_equal(servers + k,4,"\0\0\0\0")) {
+      byte_copy(servers + k,4,ip);
+      return;
+    }
+}
+
+static int haveservers(const char servers[64])
+{
+  int k;
+
+  for (k = 0;k < 64;k += 4)
+    if (byte_diff(servers + k,4,"\0\0\0\0")) return 1;
   return 0;
 }
 
+/* add the cached addresses of name server n; 0 if there are none */
+static int cachedservers(struct query *z,const char *n)
+{
+  char key[257];
+  char *cached;
+  unsigned int cachedlen;
+  unsigned int len;
+  uint32 ttl;
+  uint32 h;
+
+  len = dns_domain_length(n);
+  if (len > 255) return 0;
+  byte_copy(key,2,DNS_T_A);
+  byte_copy(key + 2,len,n);
+  case_lowerb(key + 2,len);
+
+  h = hashkey(key,len + 2);
+  cached = cache_get_wrapper(key,len + 2,h,&cachedlen,&ttl);
+  if (!cached) cached = nscache_get(key,len + 2,h,&cachedlen,&ttl);
+  if (!cached || (cachedlen < 4)) return 0;
+
+  log_cachedanswer(n,DNS_T_A);
+  while (cachedlen >= 4) {
+    addserver(z->lv[z->level]->servers,cached);
+    cached += 4;
+    cachedlen -= 4;
+  }
+  return 1;
+}
+
+/* add the addresses in the answer a lookup just left in response[] */
+static void subservers(struct query *z)
+{
+  char header[10];
+  unsigned int pos;
+  uint16 numanswers;
+  uint16 datalen;
+
+  pos = dns_packet_copy(response,response_len,0,header,8); if (!pos) return;
+  uint16_unpack_big(header + 6,&numanswers);
+  pos = dns_packet_skipname(response,response_len,12); if (!pos) return;
+  pos += 4;
+
+  while (numanswers--) {
+    pos = dns_packet_skipname(response,response_len,pos); if (!pos) return;
+    pos = dns_packet_copy(response,response_len,pos,header,10); if (!pos) return;
+    uint16_unpack_big(header + 8,&datalen);
+    if (byte_equal(header,2,DNS_T_A) && byte_equal(header + 2,2,DNS_C_IN) && (datalen == 4))
+      if (pos + 4 <= response_len)
+        addserver(z->lv[z->level]->servers,response + pos);
+    pos += datalen;
+  }
+}
+
+/* start looking up the address of name server n as z->sub[j] */
+static int substart(struct query *z,int j,const char *n)
+{
+  struct query *sub;
+
+  sub = query_new();
+  if (!sub) return 0;
+  sub->depth = z->depth + 1;
+
+  switch(query_start(sub,n,DNS_T_A,DNS_C_IN,z->localip)) {
+    case 0:
+      z->sub[j] = sub;
+      return 1;
+    case 1:
+      subservers(z);
+  }
+  query_free(sub);
+  return 1;
+}
+
+/*
+stop the lookups still running, putting their names back on z->lv[0]
+so a later batch can try them again
+*/
+static int subrequeue(struct query *z)
+{
+  int i;
+  int j;
+
+  for (i = 0;i < QUERY_MAXSUB;++i)
+    if (z->sub[i]) {
+      for (j = 0;j < QUERY_MAXNS;++j)
+        if (!z->lv[0]->ns[j]) {
+          if (!(z->lv[0]->ns[j] = intern_get(z->sub[i]->lv[0]->name))) return 0;
+          break;
+        }
+      query_free(z->sub[i]);
+      z->sub[i] = 0;
+    }
+  return 1;
+}
+
 static int doit(struct query *z,int state)
 {
   char key[257];
   char *cached;
   unsigned int cachedlen;
+  char *nscached;
+  unsigned int nscachedlen;
+  unsigned int skip;
   char *buf;
   unsigned int len;
   const char *whichserver;
   char header[12];
   char misc[20];
   unsigned int rcode;
-  unsigned int posanswers;
   uint16 numanswers;
-  unsigned int posauthority;
+  unsigned int posauthority; /* index in rr[] of the first authority record */
   uint16 numauthority;
-  unsigned int posglue;
+  unsigned int posglue; /* and of the first additional record */
   uint16 numglue;
   unsigned int pos;
   unsigned int pos2;
@@ -181,14 +535,17 @@ static int doit(struct query *z,int state)
   char *d;
   const char *dtype;
   unsigned int dlen;
+  unsigned int dlabel; /* labels stripped from the name to get d */
   char *domainName;
   int flagout;
   int flagcname;
   int flagreferral;
   int flagsoa;
+  int flaginfra;
   uint32 ttl;
   uint32 soattl;
   uint32 cnamettl;
+  uint32 h;
   int i;
   int j;
   int k;
@@ -197,24 +554,27 @@ static int doit(struct query *z,int state)
 
   errno = error_io;
   if (state == 1) goto HAVEPACKET;
+  if (state == 2) goto HAVENS;
   if (state == -1) {
-    log_servfail(z->name[z->level]);
-    goto SERVFAIL;
+    log_servfail(z->lv[z->level]->name);
+    if (z->level || (z->depth >= QUERY_MAXDEPTH)) goto SERVFAIL;
+    byte_zero(z->lv[0]->servers,64); /* all tried */
+    goto HAVENS;
   }
 
 
   NEWNAME:
   if (++z->loop == 100) goto DIE;
-  d = z->name[z->level];
-  domainName = z->name[z->level];
+  d = z->lv[z->level]->name;
+  domainName = z->lv[z->level]->name;
   dtype = z->level ? DNS_T_A : z->type;
   dlen = dns_domain_length(d);
 
   if (globalip(d,misc)) {
     if (z->level) {
       for (k = 0;k < 64;k += 4)
-        if (byte_equal(z->servers[z->level - 1] + k,4,"\0\0\0\0")) {
-	  byte_copy(z->servers[z->level - 1] + k,4,misc);
+        if (byte_equal(z->lv[z->level - 1]->servers + k,4,"\0\0\0\0")) {
+	  byte_copy(z->lv[z->level - 1]->servers + k,4,misc);
 	  break;
 	}
       goto LOWERLEVEL;
@@ -242,39 +602,53 @@ static int doit(struct query *z,int state)
     return 1;
   }
 
+  if (!z->level && !z->alias && !typematch(DNS_T_CNAME,dtype))
+    switch(chain_get(z)) {
+      case 1:
+        log_cachedanswer(d,dtype);
+        cleanup(z);
+        return 1;
+      case -1:
+        goto DIE;
+    }
+
+  hashname(&dh,d);
+  dlabel = 0;
+
   if (dlen <= 255) {
-    byte_copy(key,2,DNS_T_ANY);
-    byte_copy(key + 2,dlen,d);
-    case_lowerb(key + 2,dlen);
-    cached = cache_get_wrapper(key,dlen + 2,&cachedlen,&ttl);
+    /* no name exists below a name that does not exist (RFC 8020) */
+    cached = cache_getancestor_wrapper(DNS_T_ANY,d,&dh,0,&skip,&cachedlen,&ttl);
     if (cached) {
       log_cachednxdomain(d);
       goto NXDOMAIN;
     }
 
+    byte_copy(key + 2,dlen,d);
+    case_lowerb(key + 2,dlen);
     byte_copy(key,2,DNS_T_CNAME);
-    cached = cache_get_wrapper(key,dlen + 2,&cachedlen,&ttl);
+    cached = cache_get_wrapper(key,dlen + 2,hashtype(dh.suffix[0],DNS_T_CNAME),&cachedlen,&ttl);
     if (cached) {
       if (typematch(DNS_T_CNAME,dtype)) {
         log_cachedanswer(d,DNS_T_CNAME);
         if (!rqa(z)) goto DIE;
-	if (!response_cname(z->name[0],cached,ttl)) goto DIE;
+	if (!response_cname(z->lv[0]->name,cached,ttl)) goto DIE;
 	cleanup(z);
 	return 1;
       }
       log_cachedcname(d,cached);
-      if (!dns_domain_copy(&cname,cached)) goto DIE;
+      if (cachedlen > sizeof cname) goto DIE;
+      byte_copy(cname,cachedlen,cached);
       goto CNAME;
     }
 
     if (typematch(DNS_T_NS,dtype)) {
       byte_copy(key,2,DNS_T_NS);
-      cached = cache_get_wrapper(key,dlen + 2,&cachedlen,&ttl);
+      cached = cache_get_wrapper(key,dlen + 2,hashtype(dh.suffix[0],DNS_T_NS),&cachedlen,&ttl);
       if (cached && (cachedlen || byte_diff(dtype,2,DNS_T_ANY))) {
 	log_cachedanswer(d,DNS_T_NS);
 	if (!rqa(z)) goto DIE;
 	pos = 0;
-	while (pos = dns_packet_getname(cached,cachedlen,pos,&t2)) {
+	while (pos = dns_packet_name(cached,cachedlen,pos,t2)) {
 	  if (!response_rstart(d,DNS_T_NS,ttl)) goto DIE;
 	  if (!response_addname(t2)) goto DIE;
 	  response_rfinish(RESPONSE_ANSWER);
@@ -286,12 +660,12 @@ static int doit(struct query *z,int state)
 
     if (typematch(DNS_T_PTR,dtype)) {
       byte_copy(key,2,DNS_T_PTR);
-      cached = cache_get_wrapper(key,dlen + 2,&cachedlen,&ttl);
+      cached = cache_get_wrapper(key,dlen + 2,hashtype(dh.suffix[0],DNS_T_PTR),&cachedlen,&ttl);
       if (cached && (cachedlen || byte_diff(dtype,2,DNS_T_ANY))) {
 	log_cachedanswer(d,DNS_T_PTR);
 	if (!rqa(z)) goto DIE;
 	pos = 0;
-	while (pos = dns_packet_getname(cached,cachedlen,pos,&t2)) {
+	while (pos = dns_packet_name(cached,cachedlen,pos,t2)) {
 	  if (!response_rstart(d,DNS_T_PTR,ttl)) goto DIE;
 	  if (!response_addname(t2)) goto DIE;
 	  response_rfinish(RESPONSE_ANSWER);
@@ -303,13 +677,13 @@ static int doit(struct query *z,int state)
 
     if (typematch(DNS_T_MX,dtype)) {
       byte_copy(key,2,DNS_T_MX);
-      cached = cache_get_wrapper(key,dlen + 2,&cachedlen,&ttl);
+      cached = cache_get_wrapper(key,dlen + 2,hashtype(dh.suffix[0],DNS_T_MX),&cachedlen,&ttl);
       if (cached && (cachedlen || byte_diff(dtype,2,DNS_T_ANY))) {
 	log_cachedanswer(d,DNS_T_MX);
 	if (!rqa(z)) goto DIE;
 	pos = 0;
 	while (pos = dns_packet_copy(cached,cachedlen,pos,misc,2)) {
-	  pos = dns_packet_getname(cached,cachedlen,pos,&t2);
+	  pos = dns_packet_name(cached,cachedlen,pos,t2);
 	  if (!pos) break;
 	  if (!response_rstart(d,DNS_T_MX,ttl)) goto DIE;
 	  if (!response_addbytes(misc,2)) goto DIE;
@@ -323,14 +697,17 @@ static int doit(struct query *z,int state)
 
     if (typematch(DNS_T_A,dtype)) {
       byte_copy(key,2,DNS_T_A);
-      cached = cache_get_wrapper(key,dlen + 2,&cachedlen,&ttl);
+      h = hashtype(dh.suffix[0],DNS_T_A);
+      cached = cache_get_wrapper(key,dlen + 2,h,&cachedlen,&ttl);
+      if (!cached && (z->level || z->depth))
+        cached = nscache_get(key,dlen + 2,h,&cachedlen,&ttl);
       if (cached && (cachedlen || byte_diff(dtype,2,DNS_T_ANY))) {
 	if (z->level) {
 	  log_cachedanswer(d,DNS_T_A);
 	  while (cachedlen >= 4) {
 	    for (k = 0;k < 64;k += 4)
-	      if (byte_equal(z->servers[z->level - 1] + k,4,"\0\0\0\0")) {
-		byte_copy(z->servers[z->level - 1] + k,4,cached);
+	      if (byte_equal(z->lv[z->level - 1]->servers + k,4,"\0\0\0\0")) {
+		byte_copy(z->lv[z->level - 1]->servers + k,4,cached);
 		break;
 	      }
 	    cached += 4;
@@ -355,7 +732,7 @@ static int doit(struct query *z,int state)
 
     if (!typematch(DNS_T_ANY,dtype) && !typematch(DNS_T_AXFR,dtype) && !typematch(DNS_T_CNAME,dtype) && !typematch(DNS_T_NS,dtype) && !typematch(DNS_T_PTR,dtype) && !typematch(DNS_T_A,dtype) && !typematch(DNS_T_MX,dtype)) {
       byte_copy(key,2,dtype);
-      cached = cache_get_wrapper(key,dlen + 2,&cachedlen,&ttl);
+      cached = cache_get_wrapper(key,dlen + 2,hashtype(dh.suffix[0],dtype),&cachedlen,&ttl);
       if (cached && (cachedlen || byte_diff(dtype,2,DNS_T_ANY))) {
 	log_cachedanswer(d,dtype);
 	if (!rqa(z)) goto DIE;
@@ -376,32 +753,44 @@ static int doit(struct query *z,int state)
     }
   }
 
+/*
+One walk down the label tree finds the closest enclosing zone with NS
+records in the cache. Names below it only have to be tried in nscache.
+*/
+  nscached = 0;
+  if (!flagforwardonly && (z->level < 2))
+    nscached = cache_getancestor_wrapper(DNS_T_NS,d,&dh,1,&skip,&nscachedlen,&ttl);
+
   for (;;) {
     // Get list of servers configured during roots init
-    if (roots(z->servers[z->level], d, domainName)) {
-      for (j = 0;j < QUERY_MAXNS;++j)
-        dns_domain_free(&z->ns[z->level][j]);
-      z->control[z->level] = d;
+    if (roots(z->lv[z->level]->servers, d, domainName)) {
+      nsclear(z->lv[z->level]);
+      z->lv[z->level]->control = d;
       break;
     }
 
     if (!flagforwardonly && (z->level < 2))
       if (dlen < 255) {
-        byte_copy(key,2,DNS_T_NS);
-        byte_copy(key + 2,dlen,d);
-        case_lowerb(key + 2,dlen);
-        cached = cache_get_wrapper(key,dlen + 2,&cachedlen,&ttl);
+        if (nscached && (dlabel == skip)) {
+          cached = nscached;
+          cachedlen = nscachedlen;
+        }
+        else {
+          byte_copy(key,2,DNS_T_NS);
+          byte_copy(key + 2,dlen,d);
+          case_lowerb(key + 2,dlen);
+          cached = nscache_get(key,dlen + 2,hashtype(dh.suffix[dlabel],DNS_T_NS),&cachedlen,&ttl);
+        }
         if (cached && cachedlen) {
-	  z->control[z->level] = d;
-          byte_zero(z->servers[z->level],64);
-          for (j = 0;j < QUERY_MAXNS;++j)
-            dns_domain_free(&z->ns[z->level][j]);
+	  z->lv[z->level]->control = d;
+          byte_zero(z->lv[z->level]->servers,64);
+          nsclear(z->lv[z->level]);
           pos = 0;
           j = 0;
-          while (pos = dns_packet_getname(cached,cachedlen,pos,&t1)) {
+          while (pos = dns_packet_name(cached,cachedlen,pos,t1)) {
 	    log_cachedns(d,t1);
             if (j < QUERY_MAXNS)
-              if (!dns_domain_copy(&z->ns[z->level][j++],t1)) goto DIE;
+              if (!(z->lv[z->level]->ns[j++] = intern_get(t1))) goto DIE;
 	  }
           break;
         }
@@ -411,42 +800,69 @@ static int doit(struct query *z,int state)
     j = 1 + (unsigned int) (unsigned char) *d;
     dlen -= j;
     d += j;
+    ++dlabel;
   }
 
 
   HAVENS:
+  if (!z->level && (z->depth < QUERY_MAXDEPTH)) {
+/*
+Cached addresses are enough to go on. Otherwise look up the addresses of
+up to QUERY_MAXSUB name servers at once and continue with the first that
+arrives; query_get comes back here with state 2. Names not resolved yet
+stay in lv[0]->ns, so when every address found so far has failed or
+turned out lame, this starts the next batch before giving up.
+*/
+    for (j = 0;j < QUERY_MAXNS;++j)
+      if (z->lv[0]->ns[j])
+        if (cachedservers(z,intern_name(z->lv[0]->ns[j])))
+          nsdrop(z->lv[0],j);
+
+    while (!haveservers(z->lv[0]->servers) && !waiting(z)) {
+      k = 0;
+      for (j = 0;(j < QUERY_MAXNS) && (k < QUERY_MAXSUB);++j)
+        if (z->lv[0]->ns[j]) {
+          if (!substart(z,k++,intern_name(z->lv[0]->ns[j]))) goto DIE;
+          nsdrop(z->lv[0],j);
+        }
+      if (!k) break;
+    }
+    if (!haveservers(z->lv[0]->servers) && waiting(z)) return 0;
+    if (!subrequeue(z)) goto DIE;
+  }
+  else
   for (j = 0;j < QUERY_MAXNS;++j)
-    if (z->ns[z->level][j]) {
+    if (z->lv[z->level]->ns[j]) {
       if (z->level + 1 < QUERY_MAXLEVEL) {
-        if (!dns_domain_copy(&z->name[z->level + 1],z->ns[z->level][j])) goto DIE;
-        dns_domain_free(&z->ns[z->level][j]);
+        if (!levelstart(z,z->level + 1)) goto DIE;
+        if (!dns_domain_acopy(&z->arena,&z->lv[z->level + 1]->name,intern_name(z->lv[z->level]->ns[j]))) goto DIE;
+        nsdrop(z->lv[z->level],j);
         ++z->level;
         goto NEWNAME;
       }
-      dns_domain_free(&z->ns[z->level][j]);
+      nsdrop(z->lv[z->level],j);
     }
 
   for (j = 0;j < 64;j += 4)
-    if (byte_diff(z->servers[z->level] + j,4,"\0\0\0\0"))
+    if (byte_diff(z->lv[z->level]->servers + j,4,"\0\0\0\0"))
       break;
   if (j == 64) goto SERVFAIL;
 
-  dns_sortip(z->servers[z->level],64);
+  dns_sortip(z->lv[z->level]->servers,64);
   if (z->level) {
-    log_tx(z->name[z->level],DNS_T_A,z->control[z->level],z->servers[z->level],z->level);
-    if (dns_transmit_start(&z->dt,z->servers[z->level],flagforwardonly,z->name[z->level],DNS_T_A,z->localip) == -1) goto DIE;
+    log_tx(z->lv[z->level]->name,DNS_T_A,z->lv[z->level]->control,z->lv[z->level]->servers,z->level);
+    if (dns_transmit_start(&z->dt,z->lv[z->level]->servers,flagforwardonly,z->lv[z->level]->name,DNS_T_A,z->localip) == -1) goto DIE;
   }
   else {
-    log_tx(z->name[0],z->type,z->control[0],z->servers[0],0);
-    if (dns_transmit_start(&z->dt,z->servers[0],flagforwardonly,z->name[0],z->type,z->localip) == -1) goto DIE;
+    log_tx(z->lv[0]->name,z->type,z->lv[0]->control,z->lv[0]->servers,0);
+    if (dns_transmit_start(&z->dt,z->lv[0]->servers,flagforwardonly,z->lv[0]->name,z->type,z->localip) == -1) goto DIE;
   }
   return 0;
 
 
   LOWERLEVEL:
-  dns_domain_free(&z->name[z->level]);
-  for (j = 0;j < QUERY_MAXNS;++j)
-    dns_domain_free(&z->ns[z->level][j]);
+  z->lv[z->level]->name = 0;
+  nsclear(z->lv[z->level]);
   --z->level;
   goto HAVENS;
 
@@ -457,90 +873,82 @@ static int doit(struct query *z,int state)
   len = z->dt.packetlen;
 
   whichserver = z->dt.servers + 4 * z->dt.curserver;
-  control = z->control[z->level];
-  d = z->name[z->level];
+  control = z->lv[z->level]->control;
+  d = z->lv[z->level]->name;
   dtype = z->level ? DNS_T_A : z->type;
 
   pos = dns_packet_copy(buf,len,0,header,12); if (!pos) goto DIE;
   pos = dns_packet_skipname(buf,len,pos); if (!pos) goto DIE;
   pos += 4;
-  posanswers = pos;
 
   uint16_unpack_big(header + 6,&numanswers);
   uint16_unpack_big(header + 8,&numauthority);
   uint16_unpack_big(header + 10,&numglue);
+  posauthority = numanswers;
+  posglue = posauthority + numauthority;
+  k = posglue + numglue;
 
   rcode = header[3] & 15;
   if (rcode && (rcode != 3)) goto DIE; /* impossible; see irrelevant() */
 
+  if (k > len / 11) goto DIE; /* each record takes at least 11 bytes */
+  if (!rrspace(k)) goto DIE;
+
   flagout = 0;
   flagcname = 0;
   flagreferral = 0;
   flagsoa = 0;
   soattl = 0;
   cnamettl = 0;
-  for (j = 0;j < numanswers;++j) {
-    pos = dns_packet_getname(buf,len,pos,&t1); if (!pos) goto DIE;
+  for (j = 0;j < k;++j) {
+    rr[j].name = pos;
+    pos = dns_packet_name(buf,len,pos,t1); if (!pos) goto DIE;
+    rr[j].pos = pos;
+    rr[j].hash = namehash(t1);
     pos = dns_packet_copy(buf,len,pos,header,10); if (!pos) goto DIE;
-
-    if (dns_domain_equal(t1,d))
-      if (byte_equal(header + 2,2,DNS_C_IN)) { /* should always be true */
-        if (typematch(header,dtype))
-          flagout = 1;
-        else if (typematch(header,DNS_T_CNAME)) {
-          if (!dns_packet_getname(buf,len,pos,&cname)) goto DIE;
-          flagcname = 1;
-	  cnamettl = ttlget(header + 4);
-        }
-      }
-  
     uint16_unpack_big(header + 8,&datalen);
-    pos += datalen;
-  }
-  posauthority = pos;
-
-  for (j = 0;j < numauthority;++j) {
-    pos = dns_packet_getname(buf,len,pos,&t1); if (!pos) goto DIE;
-    pos = dns_packet_copy(buf,len,pos,header,10); if (!pos) goto DIE;
+    if (datalen > len - pos) goto DIE;
 
-    if (typematch(header,DNS_T_SOA)) {
-      flagsoa = 1;
-      soattl = ttlget(header + 4);
-      if (soattl > 3600) soattl = 3600;
+    if (j < posauthority) {
+      if (dns_domain_equal(t1,d))
+        if (byte_equal(header + 2,2,DNS_C_IN)) { /* should always be true */
+          if (typematch(header,dtype))
+            flagout = 1;
+          else if (typematch(header,DNS_T_CNAME)) {
+            if (!dns_packet_name(buf,len,pos,cname)) goto DIE;
+            flagcname = 1;
+	    cnamettl = ttlget(header + 4);
+          }
+        }
     }
-    else if (typematch(header,DNS_T_NS)) {
-      flagreferral = 1;
-      if (!dns_domain_copy(&referral,t1)) goto DIE;
+    else if (j < posglue) {
+      if (typematch(header,DNS_T_SOA)) {
+        flagsoa = 1;
+        soattl = ttlget(header + 4);
+        if (soattl > 3600) soattl = 3600;
+      }
+      else if (typematch(header,DNS_T_NS)) {
+        flagreferral = 1;
+        byte_copy(referral,dns_domain_length(t1),t1);
+      }
     }
 
-    uint16_unpack_big(header + 8,&datalen);
     pos += datalen;
   }
-  posglue = pos;
 
 
   if (!flagcname && !rcode && !flagout && flagreferral && !flagsoa)
     if (dns_domain_equal(referral,control) || !dns_domain_suffix(referral,control)) {
       log_lame(whichserver,control,referral);
-      byte_zero(whichserver,4);
+      for (j = 0;j < 64;j += 4) /* dt has its own copy of the list */
+        if (byte_equal(z->lv[z->level]->servers + j,4,whichserver))
+          byte_zero(z->lv[z->level]->servers + j,4);
       goto HAVENS;
     }
 
 
-  if (records) { alloc_free(records); records = 0; }
-
-  k = numanswers + numauthority + numglue;
-  records = (unsigned int *) alloc(k * sizeof(unsigned int));
-  if (!records) goto DIE;
-
-  pos = posanswers;
-  for (j = 0;j < k;++j) {
-    records[j] = pos;
-    pos = dns_packet_getname(buf,len,pos,&t1); if (!pos) goto DIE;
-    pos = dns_packet_copy(buf,len,pos,header,10); if (!pos) goto DIE;
-    uint16_unpack_big(header + 8,&datalen);
-    pos += datalen;
-  }
+  for (j = 0;j < k;++j)
+    records[j] = j;
 
   i = j = k;
   while (j > 1) {
@@ -549,13 +957,13 @@ static int doit(struct query *z,int state)
 
     q = i;
     while ((p = q * 2) < j) {
-      if (!smaller(buf,len,records[p],records[p - 1])) ++p;
+      if (!smaller(buf,records[p],records[p - 1])) ++p;
       records[q - 1] = records[p - 1]; q = p;
     }
     if (p == j) {
       records[q - 1] = records[p - 1]; q = p;
     }
-    while ((q > i) && smaller(buf,len,records[(p = q/2) - 1],pos)) {
+    while ((q > i) && smaller(buf,records[(p = q/2) - 1],pos)) {
       records[q - 1] = records[p - 1]; q = p;
     }
     records[q - 1] = pos;
@@ -565,20 +973,15 @@ static int doit(struct query *z,int state)
   while (i < k) {
     char type[2];
 
-    pos = dns_packet_getname(buf,len,records[i],&t1); if (!pos) goto DIE;
-    pos = dns_packet_copy(buf,len,pos,header,10); if (!pos) goto DIE;
+    if (!dns_packet_name(buf,len,rr[records[i]].name,t1)) goto DIE;
+    pos = dns_packet_copy(buf,len,rr[records[i]].pos,header,10); if (!pos) goto DIE;
     ttl = ttlget(header + 4);
 
     byte_copy(type,2,header);
     if (byte_diff(header + 2,2,DNS_C_IN)) { ++i; continue; }
 
-    for (j = i + 1;j < k;++j) {
-      pos = dns_packet_getname(buf,len,records[j],&t2); if (!pos) goto DIE;
-      pos = dns_packet_copy(buf,len,pos,header,10); if (!pos) goto DIE;
-      if (!dns_domain_equal(t1,t2)) break;
-      if (byte_diff(header,2,type)) break;
-      if (byte_diff(header + 2,2,DNS_C_IN)) break;
-    }
+    for (j = i + 1;j < k;++j)
+      if (!samerrset(buf,records[i],records[j])) break;
 
     if (!dns_domain_suffix(t1,control)) { i = j; continue; }
     if (!roots_same(t1,control)) { i = j; continue; }
@@ -587,11 +990,12 @@ static int doit(struct query *z,int state)
       ;
     else if (byte_equal(type,2,DNS_T_AXFR))
       ;
+    else if (byte_equal(type,2,DNS_T_OPT))
+      ; /* EDNS0 pseudo-record, not data */
     else if (byte_equal(type,2,DNS_T_SOA)) {
       while (i < j) {
-        pos = dns_packet_skipname(buf,len,records[i]); if (!pos) goto DIE;
-        pos = dns_packet_getname(buf,len,pos + 10,&t2); if (!pos) goto DIE;
-        pos = dns_packet_getname(buf,len,pos,&t3); if (!pos) goto DIE;
+        pos = dns_packet_name(buf,len,rr[records[i]].pos + 10,t2); if (!pos) goto DIE;
+        pos = dns_packet_name(buf,len,pos,t3); if (!pos) goto DIE;
         pos = dns_packet_copy(buf,len,pos,misc,20); if (!pos) goto DIE;
         if (records[i] < posauthority)
           log_rrsoa(whichserver,t1,t2,t3,misc,ttl);
@@ -599,16 +1003,14 @@ static int doit(struct query *z,int state)
       }
     }
     else if (byte_equal(type,2,DNS_T_CNAME)) {
-      pos = dns_packet_skipname(buf,len,records[j - 1]); if (!pos) goto DIE;
-      pos = dns_packet_getname(buf,len,pos + 10,&t2); if (!pos) goto DIE;
+      pos = dns_packet_name(buf,len,rr[records[j - 1]].pos + 10,t2); if (!pos) goto DIE;
       log_rrcname(whichserver,t1,t2,ttl);
       cachegeneric(DNS_T_CNAME,t1,t2,dns_domain_length(t2),ttl);
     }
     else if (byte_equal(type,2,DNS_T_PTR)) {
       save_start();
       while (i < j) {
-        pos = dns_packet_skipname(buf,len,records[i]); if (!pos) goto DIE;
-        pos = dns_packet_getname(buf,len,pos + 10,&t2); if (!pos) goto DIE;
+        pos = dns_packet_name(buf,len,rr[records[i]].pos + 10,t2); if (!pos) goto DIE;
         log_rrptr(whichserver,t1,t2,ttl);
         save_data(t2,dns_domain_length(t2));
         ++i;
@@ -618,20 +1020,19 @@ static int doit(struct query *z,int state)
     else if (byte_equal(type,2,DNS_T_NS)) {
       save_start();
       while (i < j) {
-        pos = dns_packet_skipname(buf,len,records[i]); if (!pos) goto DIE;
-        pos = dns_packet_getname(buf,len,pos + 10,&t2); if (!pos) goto DIE;
+        pos = dns_packet_name(buf,len,rr[records[i]].pos + 10,t2); if (!pos) goto DIE;
         log_rrns(whichserver,t1,t2,ttl);
         save_data(t2,dns_domain_length(t2));
         ++i;
       }
       save_finish(DNS_T_NS,t1,ttl);
+      save_infra(DNS_T_NS,t1,ttl);
     }
     else if (byte_equal(type,2,DNS_T_MX)) {
       save_start();
       while (i < j) {
-        pos = dns_packet_skipname(buf,len,records[i]); if (!pos) goto DIE;
-        pos = dns_packet_copy(buf,len,pos + 10,misc,2); if (!pos) goto DIE;
-        pos = dns_packet_getname(buf,len,pos,&t2); if (!pos) goto DIE;
+        pos = dns_packet_copy(buf,len,rr[records[i]].pos + 10,misc,2); if (!pos) goto DIE;
+        pos = dns_packet_name(buf,len,pos,t2); if (!pos) goto DIE;
         log_rrmx(whichserver,t1,t2,misc,ttl);
         save_data(misc,2);
         save_data(t2,dns_domain_length(t2));
@@ -640,29 +1041,27 @@ static int doit(struct query *z,int state)
       save_finish(DNS_T_MX,t1,ttl);
     }
     else if (byte_equal(type,2,DNS_T_A)) {
+      flaginfra = z->level || z->depth || (records[i] >= posglue); /* server address */
       save_start();
       while (i < j) {
-        pos = dns_packet_skipname(buf,len,records[i]); if (!pos) goto DIE;
-        pos = dns_packet_copy(buf,len,pos,header,10); if (!pos) goto DIE;
-        if (byte_equal(header + 8,2,"\0\4")) {
-          pos = dns_packet_copy(buf,len,pos,header,4); if (!pos) goto DIE;
-          save_data(header,4);
-          log_rr(whichserver,t1,DNS_T_A,header,4,ttl);
+        pos = rr[records[i]].pos;
+        if (byte_equal(buf + pos + 8,2,"\0\4")) {
+          save_data(buf + pos + 10,4);
+          log_rr(whichserver,t1,DNS_T_A,buf + pos + 10,4,ttl);
         }
         ++i;
       }
       save_finish(DNS_T_A,t1,ttl);
+      if (flaginfra) save_infra(DNS_T_A,t1,ttl);
     }
     else {
       save_start();
       while (i < j) {
-        pos = dns_packet_skipname(buf,len,records[i]); if (!pos) goto DIE;
-        pos = dns_packet_copy(buf,len,pos,header,10); if (!pos) goto DIE;
-        uint16_unpack_big(header + 8,&datalen);
-        if (datalen > len - pos) goto DIE;
-        save_data(header + 8,2);
-        save_data(buf + pos,datalen);
-        log_rr(whichserver,t1,type,buf + pos,datalen,ttl);
+        pos = rr[records[i]].pos;
+        uint16_unpack_big(buf + pos + 8,&datalen);
+        save_data(buf + pos + 8,2);
+        save_data(buf + pos + 10,datalen);
+        log_rr(whichserver,t1,type,buf + pos + 10,datalen,ttl);
         ++i;
       }
       save_finish(type,t1,ttl);
@@ -671,23 +1070,26 @@ static int doit(struct query *z,int state)
     i = j;
   }
 
-  alloc_free(records); records = 0;
-
 
   if (flagcname) {
     ttl = cnamettl;
     CNAME:
     if (!z->level) {
-      if (z->alias[QUERY_MAXALIAS - 1]) goto DIE;
+      if (!z->alias) {
+        z->alias = (struct queryalias *) arena_alloc(&z->arena,sizeof(struct queryalias));
+        if (!z->alias) goto DIE;
+        byte_zero(z->alias,sizeof(struct queryalias));
+      }
+      if (z->alias->name[QUERY_MAXALIAS - 1]) goto DIE;
       for (j = QUERY_MAXALIAS - 1;j > 0;--j)
-        z->alias[j] = z->alias[j - 1];
+        z->alias->name[j] = z->alias->name[j - 1];
       for (j = QUERY_MAXALIAS - 1;j > 0;--j)
-        z->aliasttl[j] = z->aliasttl[j - 1];
-      z->alias[0] = z->name[0];
-      z->aliasttl[0] = ttl;
-      z->name[0] = 0;
+        z->alias->ttl[j] = z->alias->ttl[j - 1];
+      z->alias->name[0] = z->lv[0]->name;
+      z->alias->ttl[0] = ttl;
+      z->lv[0]->name = 0;
     }
-    if (!dns_domain_copy(&z->name[z->level],cname)) goto DIE;
+    if (!dns_domain_acopy(&z->arena,&z->lv[z->level]->name,cname)) goto DIE;
     goto NEWNAME;
   }
 
@@ -717,31 +1119,27 @@ static int doit(struct query *z,int state)
 
   if (flagout || flagsoa || !flagreferral) {
     if (z->level) {
-      pos = posanswers;
-      for (j = 0;j < numanswers;++j) {
-        pos = dns_packet_getname(buf,len,pos,&t1); if (!pos) goto DIE;
-        pos = dns_packet_copy(buf,len,pos,header,10); if (!pos) goto DIE;
-        uint16_unpack_big(header + 8,&datalen);
+      for (j = 0;j < posauthority;++j) {
+        pos = rr[j].pos;
+        if (!dns_packet_name(buf,len,rr[j].name,t1)) goto DIE;
         if (dns_domain_equal(t1,d))
-          if (typematch(header,DNS_T_A))
-            if (byte_equal(header + 2,2,DNS_C_IN)) /* should always be true */
-              if (datalen == 4)
+          if (typematch(buf + pos,DNS_T_A))
+            if (byte_equal(buf + pos + 2,2,DNS_C_IN)) /* should always be true */
+              if (byte_equal(buf + pos + 8,2,"\0\4"))
                 for (k = 0;k < 64;k += 4)
-                  if (byte_equal(z->servers[z->level - 1] + k,4,"\0\0\0\0")) {
-                    if (!dns_packet_copy(buf,len,pos,z->servers[z->level - 1] + k,4)) goto DIE;
+                  if (byte_equal(z->lv[z->level - 1]->servers + k,4,"\0\0\0\0")) {
+                    byte_copy(z->lv[z->level - 1]->servers + k,4,buf + pos + 10);
                     break;
                   }
-        pos += datalen;
       }
       goto LOWERLEVEL;
     }
 
     if (!rqa(z)) goto DIE;
 
-    pos = posanswers;
-    for (j = 0;j < numanswers;++j) {
-      pos = dns_packet_getname(buf,len,pos,&t1); if (!pos) goto DIE;
-      pos = dns_packet_copy(buf,len,pos,header,10); if (!pos) goto DIE;
+    for (j = 0;j < posauthority;++j) {
+      if (!dns_packet_name(buf,len,rr[j].name,t1)) goto DIE;
+      pos = dns_packet_copy(buf,len,rr[j].pos,header,10); if (!pos) goto DIE;
       ttl = ttlget(header + 4);
       uint16_unpack_big(header + 8,&datalen);
       if (dns_domain_equal(t1,d))
@@ -750,32 +1148,29 @@ static int doit(struct query *z,int state)
             if (!response_rstart(t1,header,ttl)) goto DIE;
   
             if (typematch(header,DNS_T_NS) || typematch(header,DNS_T_CNAME) || typematch(header,DNS_T_PTR)) {
-              if (!dns_packet_getname(buf,len,pos,&t2)) goto DIE;
+              if (!dns_packet_name(buf,len,pos,t2)) goto DIE;
               if (!response_addname(t2)) goto DIE;
             }
             else if (typematch(header,DNS_T_MX)) {
               pos2 = dns_packet_copy(buf,len,pos,misc,2); if (!pos2) goto DIE;
               if (!response_addbytes(misc,2)) goto DIE;
-              if (!dns_packet_getname(buf,len,pos2,&t2)) goto DIE;
+              if (!dns_packet_name(buf,len,pos2,t2)) goto DIE;
               if (!response_addname(t2)) goto DIE;
             }
             else if (typematch(header,DNS_T_SOA)) {
-              pos2 = dns_packet_getname(buf,len,pos,&t2); if (!pos2) goto DIE;
+              pos2 = dns_packet_name(buf,len,pos,t2); if (!pos2) goto DIE;
               if (!response_addname(t2)) goto DIE;
-              pos2 = dns_packet_getname(buf,len,pos2,&t3); if (!pos2) goto DIE;
+              pos2 = dns_packet_name(buf,len,pos2,t3); if (!pos2) goto DIE;
               if (!response_addname(t3)) goto DIE;
               pos2 = dns_packet_copy(buf,len,pos2,misc,20); if (!pos2) goto DIE;
               if (!response_addbytes(misc,20)) goto DIE;
             }
             else {
-              if (pos + datalen > len) goto DIE;
               if (!response_addbytes(buf + pos,datalen)) goto DIE;
             }
   
             response_rfinish(RESPONSE_ANSWER);
           }
-
-      pos += datalen;
     }
 
     cleanup(z);
@@ -785,23 +1180,21 @@ static int doit(struct query *z,int state)
 
   if (!dns_domain_suffix(d,referral)) goto DIE;
   control = d + dns_domain_suffixpos(d,referral);
-  z->control[z->level] = control;
-  byte_zero(z->servers[z->level],64);
-  for (j = 0;j < QUERY_MAXNS;++j)
-    dns_domain_free(&z->ns[z->level][j]);
+  z->lv[z->level]->control = control;
+  byte_zero(z->lv[z->level]->servers,64);
+  nsclear(z->lv[z->level]);
   k = 0;
 
-  pos = posauthority;
-  for (j = 0;j < numauthority;++j) {
-    pos = dns_packet_getname(buf,len,pos,&t1); if (!pos) goto DIE;
-    pos = dns_packet_copy(buf,len,pos,header,10); if (!pos) goto DIE;
-    uint16_unpack_big(header + 8,&datalen);
+  for (j = posauthority;j < posglue;++j) {
+    if (!dns_packet_name(buf,len,rr[j].name,t1)) goto DIE;
+    pos = rr[j].pos;
     if (dns_domain_equal(referral,t1)) /* should always be true */
-      if (typematch(header,DNS_T_NS)) /* should always be true */
-        if (byte_equal(header + 2,2,DNS_C_IN)) /* should always be true */
-          if (k < QUERY_MAXNS)
-            if (!dns_packet_getname(buf,len,pos,&z->ns[z->level][k++])) goto DIE;
-    pos += datalen;
+      if (typematch(buf + pos,DNS_T_NS)) /* should always be true */
+        if (byte_equal(buf + pos + 2,2,DNS_C_IN)) /* should always be true */
+          if (k < QUERY_MAXNS) {
+            if (!dns_packet_name(buf,len,pos + 10,t2)) goto DIE;
+            if (!(z->lv[z->level]->ns[k++] = intern_get(t2))) goto DIE;
+          }
   }
 
   goto HAVENS;
@@ -817,38 +1210,142 @@ static int doit(struct query *z,int state)
 
   DIE:
   cleanup(z);
-  if (records) { alloc_free(records); records = 0; }
   return -1;
 }
 
-int query_start(struct query *z,char *dn,char type[2],char class[2],char localip[4])
+/*
+A struct query is only needed while a query is being resolved. Released
+ones go on a free list, together with the first block of their arena, so
+a busy server reaches a steady state where starting a recursion and
+copying names for it do not call malloc. Each thread has its own list.
+*/
+union freequery {
+  struct query z;
+  union freequery *next;
+} ;
+static __thread union freequery *freequeries = 0;
+
+struct query *query_new(void)
 {
+  union freequery *x;
+  struct arena arena;
+
+  x = freequeries;
+  if (x) {
+    freequeries = x->next;
+    arena = x->z.arena; /* keep its block */
+  }
+  else {
+    x = (union freequery *) alloc(sizeof(union freequery));
+    if (!x) return 0;
+    byte_zero(&arena,sizeof arena);
+  }
+  byte_zero(x,sizeof(union freequery));
+  x->z.arena = arena;
+  return &x->z;
+}
+
+void query_free(struct query *z)
+{
+  union freequery *x;
+
+  if (!z) return;
+  cleanup(z);
+  x = (union freequery *) z;
+  x->next = freequeries;
+  freequeries = x;
+}
+
+int query_start(struct query *z,const char *dn,char type[2],char class[2],char localip[4])
+{
+  int r;
+
   if (byte_equal(type,2,DNS_T_AXFR)) { errno = error_perm; return -1; }
 
   cleanup(z);
   z->level = 0;
   z->loop = 0;
 
-  if (!dns_domain_copy(&z->name[0],dn)) return -1;
+  if (!levelstart(z,0)) return -1;
+  if (!dns_domain_acopy(&z->arena,&z->lv[0]->name,dn)) return -1;
   byte_copy(z->type,2,type);
   byte_copy(z->class,2,class);
   byte_copy(z->localip,4,localip);
 
-  return doit(z,0);
+  r = doit(z,0);
+  if (r == 1) { packetcache_set(); chain_save(); }
+  return r;
 }
 
+/* how many descriptors query_io gives z */
+static unsigned int ionum(struct query *z)
+{
+  unsigned int n = 0;
+  int j;
+
+  if (!waiting(z)) return 1;
+  for (j = 0;j < QUERY_MAXSUB;++j)
+    if (z->sub[j])
+      n += ionum(z->sub[j]);
+  return n;
+}
+
+/*
+x holds the descriptors query_io left there, in the same order
+*/
 int query_get(struct query *z,iopause_fd *x,struct taia *stamp)
 {
+  unsigned int n;
+  int r;
+  int j;
+
+  if (waiting(z)) {
+    for (j = 0;j < QUERY_MAXSUB;++j)
+      if (z->sub[j]) {
+        n = ionum(z->sub[j]);
+        r = query_get(z->sub[j],x,stamp);
+        x += n;
+        if (!r) continue;
+        if (r == 1) subservers(z);
+        query_free(z->sub[j]);
+        z->sub[j] = 0;
+        if (haveservers(z->lv[0]->servers)) break;
+      }
+    if (!haveservers(z->lv[0]->servers) && waiting(z)) return 0;
+    r = doit(z,2);
+    if (r == 1) { packetcache_set(); chain_save(); }
+    return r;
+  }
+
   switch(dns_transmit_get(&z->dt,x,stamp)) {
     case 1:
-      return doit(z,1);
+      r = doit(z,1);
+      break;
     case -1:
-      return doit(z,-1);
+      r = doit(z,-1);
+      break;
+    default:
+      return 0;
   }
-  return 0;
+  if (r == 1) { packetcache_set(); chain_save(); }
+  return r;
 }
 
-void query_io(struct query *z,iopause_fd *x,struct taia *deadline)
+/*
+Fill in the descriptors to wait for, at most QUERY_MAXIO
+Return how many
+*/
+unsigned int query_io(struct query *z,iopause_fd *x,struct taia *deadline)
 {
-  dns_transmit_io(&z->dt,x,deadline);
+  unsigned int n = 0;
+  int j;
+
+  if (!waiting(z)) {
+    dns_transmit_io(&z->dt,x,deadline);
+    return 1;
+  }
+  for (j = 0;j < QUERY_MAXSUB;++j)
+    if (z->sub[j])
+      n += query_io(z->sub[j],x + n,deadline);
+  return n;
 }
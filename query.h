@@ -1,30 +1,54 @@
 #ifndef QUERY_H
 #define QUERY_H
 
+#include "arena.h"
 #include "dns.h"
 #include "uint32.h"
 
 #define QUERY_MAXLEVEL 5
 #define QUERY_MAXALIAS 16
 #define QUERY_MAXNS 16
+#define QUERY_MAXSUB 3 /* name server addresses looked up at once */
+#define QUERY_MAXDEPTH 2 /* lookups that start their own lookups that way */
+#define QUERY_MAXIO 9 /* QUERY_MAXSUB to the power QUERY_MAXDEPTH */
+
+/*
+Only the core of a query is in struct query. State for each level it
+descends to, and the CNAME chain, come from its arena when first needed,
+so a query that resolves without glue lookups or aliases carries one
+level and no alias list. Fields used on every event come first.
+*/
+
+struct querylevel {
+  char *name;
+  char *control; /* pointing inside name */
+  char servers[64];
+  uint32 ns[QUERY_MAXNS]; /* interned names, 0 if none */
+} ;
+
+struct queryalias {
+  char *name[QUERY_MAXALIAS];
+  uint32 ttl[QUERY_MAXALIAS];
+} ;
 
 struct query {
+  struct dns_transmit dt;
   unsigned int loop;
   unsigned int level;
-  char *name[QUERY_MAXLEVEL];
-  char *control[QUERY_MAXLEVEL]; /* pointing inside name */
-  char *ns[QUERY_MAXLEVEL][QUERY_MAXNS];
-  char servers[QUERY_MAXLEVEL][64];
-  char *alias[QUERY_MAXALIAS];
-  uint32 aliasttl[QUERY_MAXALIAS];
-  char localip[4];
+  struct querylevel *lv[QUERY_MAXLEVEL]; /* 0 until used */
+  struct query *sub[QUERY_MAXSUB]; /* lookups of glueless name servers */
+  unsigned int depth; /* 0, or 1 + depth of the query this is a lookup for */
   char type[2];
   char class[2];
-  struct dns_transmit dt;
+  char localip[4];
+  struct queryalias *alias; /* 0 until the first CNAME */
+  struct arena arena; /* names, lv, alias; reset by cleanup */
 } ;
 
-extern int query_start(struct query *,char *,char *,char *,char *);
-extern void query_io(struct query *,iopause_fd *,struct taia *);
+extern struct query *query_new(void);
+extern void query_free(struct query *);
+extern int query_start(struct query *,const char *,char *,char *,char *);
+extern unsigned int query_io(struct query *,iopause_fd *,struct taia *);
 extern int query_get(struct query *,iopause_fd *,struct taia *);
 
 extern void query_forwardonly(void);
@@ -1,16 +1,79 @@
 #include "dns.h"
 #include "byte.h"
+#include "case.h"
 #include "uint16.h"
 #include "response.h"
 
-char response[65535];
-unsigned int response_len = 0; /* <= 65535 */
-static unsigned int tctarget;
+/* the response under construction belongs to the calling thread */
+__thread char response[65535];
+__thread unsigned int response_len = 0; /* <= 65535 */
+__thread unsigned int response_udpmax = 512; /* room for the response over UDP */
+static __thread unsigned int tctarget;
+
+/*
+Name compression. Every suffix written below offset 16384 is a node: the
+position of its first label and the node of the rest of the name, 0 for
+the root. Nodes are found by hashing the parent node with the lowercased
+label, so a name is matched from its rightmost label leftwards with one
+lookup per label, and the number of names is not limited.
+*/
+#define NODES 8192 /* each node below 16384 has at least 2 bytes */
+#define BUCKETS 1024
+static __thread struct node {
+  unsigned int pos;
+  unsigned int parent;
+  unsigned int next;
+} node[NODES + 1];
+static __thread unsigned int node_num;
+static __thread unsigned int bucket[BUCKETS];
+static __thread unsigned int bucket_gen[BUCKETS]; /* bucket valid if == gen */
+static __thread unsigned int gen;
+
+static unsigned int hash(unsigned int parent,const char *label)
+{
+  unsigned int h = 5381 + parent;
+  unsigned int len = 1 + (unsigned char) *label;
+  unsigned char ch;
+
+  while (len--) {
+    ch = *label++;
+    if (ch >= 'A' && ch <= 'Z') ch += 32;
+    h = (h << 5) + h;
+    h ^= ch;
+  }
+  return h & (BUCKETS - 1);
+}
+
+static unsigned int node_find(unsigned int parent,const char *label)
+{
+  unsigned int b = hash(parent,label);
+  unsigned int i;
+  const char *x;
+
+  if (bucket_gen[b] != gen) return 0;
+  for (i = bucket[b];i;i = node[i].next) {
+    if (node[i].parent != parent) continue;
+    x = response + node[i].pos;
+    if (*x != *label) continue;
+    if (!case_diffb(x + 1,(unsigned char) *label,label + 1)) return i;
+  }
+  return 0;
+}
 
-#define NAMES 100
-static char name[NAMES][128];
-static unsigned int name_ptr[NAMES]; /* each < 16384 */
-static unsigned int name_num;
+static unsigned int node_add(unsigned int parent,const char *label,unsigned int pos)
+{
+  unsigned int b = hash(parent,label);
+  unsigned int i;
+
+  if (node_num >= NODES) return 0;
+  i = ++node_num;
+  node[i].pos = pos;
+  node[i].parent = parent;
+  node[i].next = (bucket_gen[b] == gen) ? bucket[b] : 0;
+  bucket[b] = i;
+  bucket_gen[b] = gen;
+  return i;
+}
 
 int response_addbytes(const char *buf,unsigned int len)
 {
@@ -22,37 +85,53 @@ int response_addbytes(const char *buf,unsigned int len)
 
 int response_addname(const char *d)
 {
-  unsigned int dlen;
+  unsigned int label[129]; /* offsets of the labels, then of the end */
+  unsigned int n = 0;
   unsigned int i;
+  unsigned int pos;
+  unsigned int parent = 0;
+  unsigned int found;
   char buf[2];
 
-  dlen = dns_domain_length(d);
-
-  while (*d) {
-    for (i = 0;i < name_num;++i)
-      if (dns_domain_equal(d,name[i])) {
-        uint16_pack_big(buf,49152 + name_ptr[i]);
-        return response_addbytes(buf,2);
-      }
-    if (dlen <= 128)
-      if (name_num < NAMES) {
-	byte_copy(name[name_num],dlen,d);
-	name_ptr[name_num] = response_len;
-	++name_num;
-      }
-    i = (unsigned char) *d;
-    ++i;
-    if (!response_addbytes(d,i)) return 0;
-    d += i;
-    dlen -= i;
+  for (i = 0;d[i];i += 1 + (unsigned char) d[i]) {
+    if (n == 128) return 0;
+    label[n++] = i;
+  }
+  label[n] = i;
+
+  while (n) {
+    found = node_find(parent,d + label[n - 1]);
+    if (!found) break;
+    parent = found;
+    --n;
   }
-  return response_addbytes(d,1);
+
+  pos = response_len;
+  if (!response_addbytes(d,label[n])) return 0;
+  if (parent)
+    uint16_pack_big(buf,49152 + node[parent].pos);
+  else
+    buf[0] = 0;
+
+  found = parent;
+  while (n) {
+    --n;
+    if (pos + label[n] >= 16384) break;
+    found = node_add(found,d + label[n],pos + label[n]);
+    if (!found) break;
+  }
+
+  return response_addbytes(buf,parent ? 2 : 1);
 }
 
 int response_query(const char *q,const char qtype[2],const char qclass[2])
 {
   response_len = 0;
-  name_num = 0;
+  node_num = 0;
+  if (!++gen) {
+    byte_zero(bucket_gen,sizeof bucket_gen);
+    gen = 1;
+  }
   if (!response_addbytes("\0\0\201\200\0\1\0\0\0\0\0\0",12)) return 0;
   if (!response_addname(q)) return 0;
   if (!response_addbytes(qtype,2)) return 0;
@@ -61,7 +140,7 @@ int response_query(const char *q,const char qtype[2],const char qclass[2])
   return 1;
 }
 
-static unsigned int dpos;
+static __thread unsigned int dpos;
 
 static int flaghidettl = 0;
 
@@ -70,14 +149,19 @@ void response_hidettl(void)
   flaghidettl = 1;
 }
 
+/* the TTL to send for a record cached with ttl */
+uint32 response_ttl(uint32 ttl)
+{
+  return flaghidettl ? 0 : ttl;
+}
+
 int response_rstart(const char *d,const char type[2],uint32 ttl)
 {
   char ttlstr[4];
   if (!response_addname(d)) return 0;
   if (!response_addbytes(type,2)) return 0;
   if (!response_addbytes(DNS_C_IN,2)) return 0;
-  if (flaghidettl) ttl = 0;
-  uint32_pack_big(ttlstr,ttl);
+  uint32_pack_big(ttlstr,response_ttl(ttl));
   if (!response_addbytes(ttlstr,4)) return 0;
   if (!response_addbytes("\0\0",2)) return 0;
   dpos = response_len;
@@ -114,8 +198,26 @@ void response_id(const char id[2])
   byte_copy(response,2,id);
 }
 
+/* cut back to the question; the counts must not claim records that are gone */
 void response_tc(void)
 {
   response[2] |= 2;
   response_len = tctarget;
+  byte_zero(response + 6,6);
+}
+
+/* EDNS0: append an OPT record advertising udpsize to the additional section */
+int response_opt(unsigned int udpsize)
+{
+  char buf[11];
+  uint16 num;
+
+  byte_copy(buf,3,"\0" DNS_T_OPT);
+  uint16_pack_big(buf + 3,udpsize);
+  byte_zero(buf + 5,6);
+  if (!response_addbytes(buf,11)) return 0;
+
+  uint16_unpack_big(response + RESPONSE_ADDITIONAL,&num);
+  uint16_pack_big(response + RESPONSE_ADDITIONAL,num + 1);
+  return 1;
 }
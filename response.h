@@ -3,18 +3,21 @@
 
 #include "uint32.h"
 
-extern char response[];
-extern unsigned int response_len;
+extern __thread char response[];
+extern __thread unsigned int response_len;
+extern __thread unsigned int response_udpmax;
 
 extern int response_query(const char *,const char *,const char *);
 extern void response_nxdomain(void);
 extern void response_servfail(void);
 extern void response_id(const char *);
 extern void response_tc(void);
+extern int response_opt(unsigned int);
 
 extern int response_addbytes(const char *,unsigned int);
 extern int response_addname(const char *);
 extern void response_hidettl(void);
+extern uint32 response_ttl(uint32);
 extern int response_rstart(const char *,const char *,uint32);
 extern void response_rfinish(int);
 
@@ -19,6 +19,21 @@ export ROOT=./root
 export IP=127.0.0.1
 export IPSEND=0.0.0.0
 export CACHESIZE=1024576
+# full-response cache answering repeat questions without query.c, 0 disables it
+export PACKETCACHESIZE=1048576
+# NS and server address cache that ordinary answers cannot evict, 0 disables it
+export NSCACHESIZE=4194304
+# concurrent UDP queries and TCP connections, the oldest is dropped when full
+export MAXUDP=20000
+export MAXTCP=1000
+# event loop threads, each with its own sockets bound with SO_REUSEPORT
+export WORKERS=1
+# outgoing UDP sockets each worker keeps bound to random ports, 0 disables
+export UDPPOOL=64
+# percent of upstream queries that may also go to a second server, 0 disables
+export HEDGE=5
+# names listed in this file under root are purged from the caches when it changes
+export PURGE=purge
 export CUSTOMDOMAIN=myip.opendns.com
 # domain length when encoded 4myip7opendns3com + null char
 export CUSTOMDNSDOMAINLEN=18
@@ -1,6 +1,7 @@
 #include "byte.h"
 #include "case.h"
 #include "env.h"
+#include "scan.h"
 #include "buffer.h"
 #include "strerr.h"
 #include "ip4.h"
@@ -25,6 +26,9 @@ static int len;
 
 static char *q;
 
+static unsigned int ednsmax = 1232; /* 0: no EDNS0 */
+static unsigned int edns; /* payload size the client advertised, or 0 */
+
 static int doit(void)
 {
   unsigned int pos;
@@ -42,6 +46,10 @@ static int doit(void)
   pos = dns_packet_copy(buf,len,pos,qtype,2); if (!pos) goto NOQ;
   pos = dns_packet_copy(buf,len,pos,qclass,2); if (!pos) goto NOQ;
 
+  edns = ednsmax ? dns_packet_edns0(buf,len,pos) : 0;
+  response_udpmax = 512;
+  if (edns) response_udpmax = ((edns < ednsmax) ? edns : ednsmax) - 11;
+
   if (!response_query(q,qtype,qclass)) goto NOQ;
   response_id(header);
   if (byte_equal(qclass,2,DNS_C_IN))
@@ -84,6 +92,13 @@ int main()
   char *x;
   int udp53;
 
+  x = env_get("EDNSSIZE");
+  if (x) {
+    scan_uint(x,&ednsmax);
+    if (ednsmax && (ednsmax < 512)) ednsmax = 512;
+    if (ednsmax > 4096) ednsmax = 4096;
+  }
+
   x = env_get("IP");
   if (!x)
     strerr_die2x(111,fatal,"$IP not set");
@@ -109,7 +124,8 @@ int main()
     len = socket_recv4(udp53,buf,sizeof buf,ip,&port);
     if (len < 0) continue;
     if (!doit()) continue;
-    if (response_len > 512) response_tc();
+    if (response_len > response_udpmax) response_tc();
+    if (edns) response_opt(ednsmax);
     socket_send4(udp53,response,response_len,ip,port);
     /* may block for buffer space; if it fails, too bad */
   }
@@ -10,10 +10,26 @@ extern int socket_connect4(int,const char *,uint16);
 extern int socket_connected(int);
 extern int socket_bind4(int,char *,uint16);
 extern int socket_bind4_reuse(int,char *,uint16);
+extern int socket_bind4_reuseport(int,char *,uint16);
 extern int socket_listen(int,int);
 extern int socket_accept4(int,char *,uint16 *);
 extern int socket_recv4(int,char *,int,char *,uint16 *);
 extern int socket_send4(int,const char *,int,const char *,uint16);
+
+/* for socket_recvmany4 and socket_sendmany4 */
+#define SOCKET_MANY 64
+
+struct socket_datagram {
+  char *buf;
+  unsigned int size; /* space in buf, for socket_recvmany4 */
+  unsigned int len;
+  char ip[4];
+  uint16 port;
+} ;
+
+extern int socket_recvmany4(int,struct socket_datagram *,unsigned int);
+extern int socket_sendmany4(int,struct socket_datagram *,unsigned int);
+
 extern int socket_local4(int,char *,uint16 *);
 extern int socket_remote4(int,char *,uint16 *);
 
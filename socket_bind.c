@@ -24,6 +24,14 @@ int socket_bind4_reuse(int s,char ip[4],uint16 port)
   return socket_bind4(s,ip,port);
 }
 
+int socket_bind4_reuseport(int s,char ip[4],uint16 port)
+{
+  int opt = 1;
+  setsockopt(s,SOL_SOCKET,SO_REUSEADDR,&opt,sizeof opt);
+  if (setsockopt(s,SOL_SOCKET,SO_REUSEPORT,&opt,sizeof opt) == -1) return -1;
+  return socket_bind4(s,ip,port);
+}
+
 void socket_tryreservein(int s,int size)
 {
   while (size >= 1024) {
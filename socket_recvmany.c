@@ -0,0 +1,50 @@
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include "byte.h"
+#include "socket.h"
+
+/* struct mmsghdr, which the C library only declares with _GNU_SOURCE */
+struct mmsg {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+} ;
+
+/*
+Read up to n datagrams without blocking, each into d[i].buf of d[i].size
+Return the number read, with len, ip and port filled in; -1 on failure
+*/
+int socket_recvmany4(int s,struct socket_datagram *d,unsigned int n)
+{
+  struct mmsg msg[SOCKET_MANY];
+  struct iovec iov[SOCKET_MANY];
+  struct sockaddr_in sa[SOCKET_MANY];
+  unsigned int i;
+  int r;
+
+  if (n > SOCKET_MANY) n = SOCKET_MANY;
+
+  byte_zero(msg,n * sizeof(struct mmsg));
+  for (i = 0;i < n;++i) {
+    iov[i].iov_base = d[i].buf;
+    iov[i].iov_len = d[i].size;
+    msg[i].msg_hdr.msg_name = &sa[i];
+    msg[i].msg_hdr.msg_namelen = sizeof sa[i];
+    msg[i].msg_hdr.msg_iov = &iov[i];
+    msg[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  r = syscall(SYS_recvmmsg,s,msg,n,MSG_DONTWAIT,0);
+  if (r == -1) return -1;
+
+  for (i = 0;i < r;++i) {
+    d[i].len = msg[i].msg_len;
+    byte_copy(d[i].ip,4,(char *) &sa[i].sin_addr);
+    uint16_unpack_big((char *) &sa[i].sin_port,&d[i].port);
+  }
+
+  return r;
+}
@@ -0,0 +1,57 @@
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include "byte.h"
+#include "socket.h"
+
+/* struct mmsghdr, which the C library only declares with _GNU_SOURCE */
+struct mmsg {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+} ;
+
+/*
+Send d[0].buf ... d[n-1].buf, each of d[i].len bytes, to d[i].ip and d[i].port
+A datagram the kernel refuses is skipped, like a failed socket_send4
+Return the number sent
+*/
+int socket_sendmany4(int s,struct socket_datagram *d,unsigned int n)
+{
+  struct mmsg msg[SOCKET_MANY];
+  struct iovec iov[SOCKET_MANY];
+  struct sockaddr_in sa[SOCKET_MANY];
+  unsigned int i;
+  unsigned int pos;
+  int sent;
+  int r;
+
+  if (n > SOCKET_MANY) n = SOCKET_MANY;
+
+  byte_zero(msg,n * sizeof(struct mmsg));
+  byte_zero(sa,n * sizeof(struct sockaddr_in));
+  for (i = 0;i < n;++i) {
+    sa[i].sin_family = AF_INET;
+    uint16_pack_big((char *) &sa[i].sin_port,d[i].port);
+    byte_copy((char *) &sa[i].sin_addr,4,d[i].ip);
+    iov[i].iov_base = d[i].buf;
+    iov[i].iov_len = d[i].len;
+    msg[i].msg_hdr.msg_name = &sa[i];
+    msg[i].msg_hdr.msg_namelen = sizeof sa[i];
+    msg[i].msg_hdr.msg_iov = &iov[i];
+    msg[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  sent = 0;
+  pos = 0;
+  while (pos < n) {
+    r = syscall(SYS_sendmmsg,s,msg + pos,n - pos,0);
+    if (r <= 0) { ++pos; continue; } /* skip the datagram that failed */
+    pos += r;
+    sent += r;
+  }
+
+  return sent;
+}
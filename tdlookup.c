@@ -12,7 +12,7 @@
 static int want(const char *owner,const char type[2])
 {
   unsigned int pos;
-  static char *d;
+  char d[255];
   char x[10];
   uint16 datalen;
 
@@ -20,7 +20,7 @@ static int want(const char *owner,const char type[2])
   pos += 4;
 
   while (pos < response_len) {
-    pos = dns_packet_getname(response,response_len,pos,&d); if (!pos) return 0;
+    pos = dns_packet_name(response,response_len,pos,d); if (!pos) return 0;
     pos = dns_packet_copy(response,response_len,pos,x,10); if (!pos) return 0;
     if (dns_domain_equal(d,owner))
       if (byte_equal(type,2,x))
@@ -31,7 +31,7 @@ static int want(const char *owner,const char type[2])
   return 1;
 }
 
-static char *d1;
+static char d1[255];
 
 static char clientloc[2];
 static struct tai now;
@@ -98,7 +98,7 @@ static int dobytes(unsigned int len)
 
 static int doname(void)
 {
-  dpos = dns_packet_getname(data,dlen,dpos,&d1);
+  dpos = dns_packet_name(data,dlen,dpos,d1);
   if (!dpos) return 0;
   return response_addname(d1);
 }
@@ -245,10 +245,10 @@ static int doit(char *q,char qtype[2])
     bpos = dns_packet_copy(response,arpos,bpos,x,10); if (!bpos) return 0;
     if (byte_equal(x,2,DNS_T_NS) || byte_equal(x,2,DNS_T_MX)) {
       if (byte_equal(x,2,DNS_T_NS)) {
-        if (!dns_packet_getname(response,arpos,bpos,&d1)) return 0;
+        if (!dns_packet_name(response,arpos,bpos,d1)) return 0;
       }
       else
-        if (!dns_packet_getname(response,arpos,bpos + 2,&d1)) return 0;
+        if (!dns_packet_name(response,arpos,bpos + 2,d1)) return 0;
       case_lowerb(d1,dns_domain_length(d1));
       if (want(d1,DNS_T_A)) {
 	cdb_findstart(&c);
@@ -266,10 +266,10 @@ static int doit(char *q,char qtype[2])
     bpos += u16;
   }
 
-  if (flagauthoritative && (response_len > 512)) {
+  if (flagauthoritative && (response_len > response_udpmax)) {
     byte_zero(response + RESPONSE_ADDITIONAL,2);
     response_len = arpos;
-    if (response_len > 512) {
+    if (response_len > response_udpmax) {
       byte_zero(response + RESPONSE_AUTHORITY,2);
       response_len = aupos;
     }
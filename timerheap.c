@@ -0,0 +1,115 @@
+#include "alloc.h"
+#include "byte.h"
+#include "taia.h"
+#include "timerheap.h"
+
+/*
+ * Binary min-heap of deadlines for ids 0...max-1
+ * Each id is queued at most once; setting a queued id moves it.
+ * Every operation is O(log n) in the number of queued ids.
+ */
+
+static void place(struct timerheap *t,unsigned int i,unsigned int id)
+{
+  t->heap[i] = id;
+  t->pos[id] = i + 1;
+}
+
+static void up(struct timerheap *t,unsigned int i)
+{
+  unsigned int id = t->heap[i];
+  unsigned int parent;
+
+  while (i) {
+    parent = (i - 1) / 2;
+    if (!taia_less(&t->deadline[id],&t->deadline[t->heap[parent]])) break;
+    place(t,i,t->heap[parent]);
+    i = parent;
+  }
+  place(t,i,id);
+}
+
+static void down(struct timerheap *t,unsigned int i)
+{
+  unsigned int id = t->heap[i];
+  unsigned int child;
+
+  for (;;) {
+    child = 2 * i + 1;
+    if (child >= t->len) break;
+    if (child + 1 < t->len)
+      if (taia_less(&t->deadline[t->heap[child + 1]],&t->deadline[t->heap[child]]))
+        ++child;
+    if (!taia_less(&t->deadline[t->heap[child]],&t->deadline[id])) break;
+    place(t,i,t->heap[child]);
+    i = child;
+  }
+  place(t,i,id);
+}
+
+void timerheap_set(struct timerheap *t,unsigned int id,const struct taia *when)
+{
+  unsigned int i;
+
+  if (id >= t->max) return;
+  t->deadline[id] = *when;
+
+  if (!t->pos[id]) {
+    i = t->len++;
+    place(t,i,id);
+    up(t,i);
+    return;
+  }
+
+  up(t,t->pos[id] - 1);
+  down(t,t->pos[id] - 1);
+}
+
+void timerheap_del(struct timerheap *t,unsigned int id)
+{
+  unsigned int i;
+  unsigned int last;
+
+  if (id >= t->max) return;
+  if (!t->pos[id]) return;
+
+  i = t->pos[id] - 1;
+  t->pos[id] = 0;
+  if (i == --t->len) return;
+
+  last = t->heap[t->len];
+  place(t,i,last);
+  up(t,i);
+  down(t,t->pos[last] - 1);
+}
+
+/*
+ * Return 1 and the earliest id with its deadline, 0 if nothing is queued
+ */
+int timerheap_min(struct timerheap *t,unsigned int *id,struct taia *when)
+{
+  if (!t->len) return 0;
+  *id = t->heap[0];
+  *when = t->deadline[*id];
+  return 1;
+}
+
+/*
+ * Return 1 on success, 0 on failure
+ */
+int timerheap_init(struct timerheap *t,unsigned int max)
+{
+  t->len = 0;
+  t->max = 0;
+
+  t->heap = (unsigned int *) alloc(max * sizeof(unsigned int));
+  if (!t->heap) return 0;
+  t->pos = (unsigned int *) alloc(max * sizeof(unsigned int));
+  if (!t->pos) return 0;
+  t->deadline = (struct taia *) alloc(max * sizeof(struct taia));
+  if (!t->deadline) return 0;
+
+  byte_zero(t->pos,max * sizeof(unsigned int));
+  t->max = max;
+  return 1;
+}
@@ -0,0 +1,19 @@
+#ifndef TIMERHEAP_H
+#define TIMERHEAP_H
+
+#include "taia.h"
+
+struct timerheap {
+  unsigned int *heap; /* ids, ordered by deadline */
+  unsigned int *pos; /* indexed by id: 1 + position in heap, or 0 */
+  struct taia *deadline; /* indexed by id */
+  unsigned int len;
+  unsigned int max;
+} ;
+
+extern int timerheap_init(struct timerheap *,unsigned int);
+extern void timerheap_set(struct timerheap *,unsigned int,const struct taia *);
+extern void timerheap_del(struct timerheap *,unsigned int);
+extern int timerheap_min(struct timerheap *,unsigned int *,struct taia *);
+
+#endif
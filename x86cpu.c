@@ -0,0 +1,41 @@
+#include "x86cpu.h"
+
+static int avx2 = -1; /* unknown; set once, any thread may race to it */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+static void cpuid(unsigned int leaf,unsigned int r[4])
+{
+  asm volatile("cpuid" : "=a"(r[0]),"=b"(r[1]),"=c"(r[2]),"=d"(r[3]) : "0"(leaf),"2"(0));
+}
+
+static int probe(void)
+{
+  unsigned int r[4];
+  unsigned int lo;
+  unsigned int hi;
+
+  cpuid(0,r);
+  if (r[0] < 7) return 0;
+  cpuid(1,r);
+  if (!(r[2] & (1 << 27))) return 0; /* OSXSAVE */
+  asm volatile("xgetbv" : "=a"(lo),"=d"(hi) : "c"(0));
+  if ((lo & 6) != 6) return 0; /* kernel saves XMM and YMM state */
+  cpuid(7,r);
+  return (r[1] >> 5) & 1;
+}
+
+#else
+
+static int probe(void)
+{
+  return 0;
+}
+
+#endif
+
+int x86cpu_avx2(void)
+{
+  if (avx2 < 0) avx2 = probe();
+  return avx2;
+}
@@ -0,0 +1,8 @@
+#ifndef X86CPU_H
+#define X86CPU_H
+
+/* run-time probe for vector instructions, same cpuid as x86cpuid.c */
+
+extern int x86cpu_avx2(void);
+
+#endif